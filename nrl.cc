@@ -1,4 +1,5 @@
 #include "nrl.hh"
+#include "config.hh"
 #include <string>
 #include <variant>
 
@@ -8,7 +9,10 @@ import std;
 # include <algorithm>
 # include <array>
 # include <cassert>
+# include <cctype>
 # include <cerrno>
+# include <charconv>
+# include <chrono>
 # include <compare>
 # include <csignal> // IWYU pragma: keep
 # include <cstddef>
@@ -18,20 +22,44 @@ import std;
 # include <filesystem>
 # include <format>
 # include <map>
+# include <mutex>
 # include <string_view>
 # include <vector>
 #endif
 
 #include <error.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
+#ifdef NRL_IO_URING
+# include <liburing.h>
+#endif
+
+#if NRL_PROBES
+# include <sys/sdt.h>
+# define PROBE(...) STAP_PROBEV(nrl, __VA_ARGS__)
+#else
+# define PROBE(...) ((void) 0)
+#endif
 
 #include <unictype.h>
+#include <unigbrk.h>
 #include <unistr.h>
+#include <uniwidth.h>
+
+#if defined __x86_64__ || defined __i386__
+# include <immintrin.h>
+#elif defined __ARM_NEON && defined __aarch64__
+# include <arm_neon.h>
+#endif
 
 #include "termdetect/termdetect.hh"
 
@@ -43,22 +71,182 @@ namespace nrl {
 
   namespace {
 
+    // Update the statistics if they are maintained.
+    inline void count(handle& s, uint64_t handle::statistics::* counter, uint64_t n = 1)
+    {
+      if constexpr (NRL_STATS)
+        s.counters.*counter += n;
+    }
+
+
+    // With NRL_CHECKS the results of the optimized code are compared with those of simple
+    // reference implementations.  A difference is a bug.
+    void verify(bool ok, const char* what)
+    {
+      if (! ok) [[unlikely]]
+        ::error(EXIT_FAILURE, 0, "%s differs from the reference implementation ?!", what);
+    }
+
+
+    // Count the UTF-8 encoded characters in the N bytes starting at P.  Every byte except the
+    // continuation bytes (0x80 to 0xbf) starts a character.  Interpreted as signed values the
+    // continuation bytes are exactly the values less than -64 which allows vectorized comparisons.
+    size_t count_chars_scalar(const uint8_t* p, size_t n)
+    {
+      size_t res = 0;
+      for (size_t i = 0; i < n; ++i)
+        res += (p[i] & 0xc0) != 0x80;
+      return res;
+    }
+
+
+#if defined __x86_64__ || defined __i386__
+# ifdef __SSE2__
+    size_t count_chars_sse2(const uint8_t* p, size_t n)
+    {
+      size_t res = 0;
+      size_t i = 0;
+      const auto limit = _mm_set1_epi8(-65);
+      for (; i + 16 <= n; i += 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        res += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(v, limit)));
+      }
+      return res + count_chars_scalar(p + i, n - i);
+    }
+# endif
+
+
+    __attribute__((target("avx2"))) size_t count_chars_avx2(const uint8_t* p, size_t n)
+    {
+      size_t res = 0;
+      size_t i = 0;
+      const auto limit = _mm256_set1_epi8(-65);
+      for (; i + 32 <= n; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        res += __builtin_popcount(unsigned(_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, limit))));
+      }
+      return res + count_chars_scalar(p + i, n - i);
+    }
+#elif defined __ARM_NEON && defined __aarch64__
+    // The horizontal addition vaddvq_u8 is only available in the AArch64 instruction set.
+    size_t count_chars_neon(const uint8_t* p, size_t n)
+    {
+      size_t res = 0;
+      size_t i = 0;
+      const auto limit = vdupq_n_s8(-65);
+      for (; i + 16 <= n; i += 16) {
+        auto v = vreinterpretq_s8_u8(vld1q_u8(p + i));
+        res += vaddvq_u8(vshrq_n_u8(vcgtq_s8(v, limit), 7));
+      }
+      return res + count_chars_scalar(p + i, n - i);
+    }
+#endif
+
+
+    using count_chars_fct = size_t (*)(const uint8_t*, size_t);
+
+    count_chars_fct select_count_chars()
+    {
+#if defined __x86_64__ || defined __i386__
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+        return count_chars_avx2;
+# ifdef __SSE2__
+      return count_chars_sse2;
+# endif
+#elif defined __ARM_NEON && defined __aarch64__
+      return count_chars_neon;
+#endif
+      return count_chars_scalar;
+    }
+
+    // The implementation is selected on first use based on the capabilities of the CPU.  The
+    // function-local static does not depend on the order in which the dynamic initializers of the
+    // program run, the function can be used in the initialization of other objects.
+    size_t count_chars(const uint8_t* p, size_t n)
+    {
+      static const count_chars_fct fct = select_count_chars();
+      return fct(p, n);
+    }
+
+
+    // Determine the number of bytes used by the first N characters in the LEN bytes starting at P
+    // and the number of characters found (which is less than N only if the string is too short).
+    // Whole blocks are skipped using the vectorized counting function, the remainder is handled
+    // byte-by-byte.  The returned offset is that of the start of character N+1 or LEN.
+    std::tuple<size_t, size_t> advance_chars(const uint8_t* p, size_t len, size_t n)
+    {
+      constexpr size_t block = 64;
+      size_t cnt = 0;
+      size_t i = 0;
+      while (i + block <= len) {
+        auto c = count_chars(p + i, block);
+        if (cnt + c > n)
+          break;
+        cnt += c;
+        i += block;
+      }
+      for (; i < len; ++i)
+        if ((p[i] & 0xc0) != 0x80) {
+          if (cnt == n)
+            break;
+          ++cnt;
+        }
+      if constexpr (NRL_CHECKS) {
+        verify(count_chars(p, len) == count_chars_scalar(p, len), "count_chars");
+        size_t j = 0;
+        size_t c = 0;
+        for (; j < len && (c < n || (p[j] & 0xc0) == 0x80); ++j)
+          c += (p[j] & 0xc0) != 0x80;
+        verify(i == j && cnt == c, "advance_chars");
+      }
+      return {i, cnt};
+    }
+
+
+    // Reference for nonescape_len, a state machine looking at one byte at a time.
+    size_t nonescape_len_reference(const std::string_view sv)
+    {
+      size_t res = 0;
+      bool in_esc = false;
+      for (auto ch : sv) {
+        auto c = static_cast<uint8_t>(ch);
+        if (in_esc)
+          in_esc = c == '[' || c < 0x40 || c > 0x7e;
+        else if (c == '\e')
+          in_esc = true;
+        else
+          res += (c & 0xc0) != 0x80;
+      }
+      return res;
+    }
+
+
     // Return the length of the visible characters of the string.  ANSI escape sequences are not counted.
     // At this time only CSI sequences have to be handled.  The encoding is known to be UTF-8.
     size_t nonescape_len(const std::string_view sv)
     {
-      bool in_csi = false;
       size_t res = 0;
-      for (char ch : sv)
-        if (! in_csi) {
-          if (ch == '\x1b') [[unlikely]]
-            in_csi = true;
-          else if ((ch & 0xc0) != 0x80)
-            ++res;
-        } else
-          // CSI sequences end with a character in the range 0x40 ('@') to 0x7e ('~').
-          in_csi &= ch == '[' || static_cast<uint8_t>(ch) < 0x40 || static_cast<uint8_t>(ch) > 0x7e;
+      auto p = sv.data();
+      auto end = p + sv.size();
+      while (p < end) {
+        auto esc = static_cast<const char*>(std::memchr(p, '\x1b', end - p));
+        if (esc == nullptr)
+          esc = end;
+        res += count_chars(reinterpret_cast<const uint8_t*>(p), esc - p);
+        if (esc == end)
+          break;
+
+        // CSI sequences end with a character in the range 0x40 ('@') to 0x7e ('~').
+        p = esc + 1;
+        while (p < end && (*p == '[' || static_cast<uint8_t>(*p) < 0x40 || static_cast<uint8_t>(*p) > 0x7e))
+          ++p;
+        if (p < end)
+          ++p;
+      }
 
+      if constexpr (NRL_CHECKS)
+        verify(res == nonescape_len_reference(sv), "nonescape_len");
       return res;
     }
 
@@ -160,11 +348,228 @@ namespace nrl {
       return std::make_tuple(hsv_to_rgb(hsv_fg), hsv_to_rgb(hsv_bg));
     }
 
+  } // anonymous namespace
+
+
+  // Colors derived from the terminal's default colors.  They depend only on the terminal and the
+  // frame style.
+  struct derived_colors {
+    terminal::info::color frame_highlight_fg;
+    terminal::info::color text_default_fg;
+    terminal::info::color text_default_bg;
+    terminal::info::color empty_message_fg;
+    std::string colsel;
+  };
+
+
+  // Entry of the process-wide cache of terminal information.  The handles using the information
+  // keep a reference to the entry so that the derived colors are found without a lookup.
+  struct handle::terminal_entry {
+    std::shared_ptr<terminal::info> info;
+    // The terminal is probed once, without holding terminal_cache_lock.
+    std::once_flag probed;
+    // Protects COLORS which is indexed by the frame style.
+    std::mutex lock;
+    std::array<std::optional<derived_colors>, 4> colors{};
+  };
+
+
+  namespace {
+
+    derived_colors compute_colors(const terminal::info& info, handle::flags fl)
+    {
+      derived_colors res{};
+      if ((fl & handle::flags::frame) == handle::flags::frame_background) {
+        // We use as foreground a slightly adjusted version of the default background colors.
+        auto [fg, bg] = adjust_rgb(info.default_foreground, info.default_background, 32);
+        res.frame_highlight_fg = bg;
+        res.text_default_fg = fg;
+        res.text_default_bg = bg;
+        res.colsel = std::format("\e[38;2;{};{};{};48;2;{};{};{}m", fg.r, fg.g, fg.b, bg.r, bg.g, bg.b);
+      }
+
+      // Determine the foreground color to use for the empty message.  It should be darker than the usual.
+      terminal::info::color fg;
+      terminal::info::color bg;
+      if ((fl & handle::flags::frame) != handle::flags::frame_background)
+        std::tie(fg, bg) = adjust_rgb(info.default_foreground, info.default_background, 48);
+      else
+        std::tie(fg, bg) = adjust_rgb(res.text_default_fg, res.text_default_bg, 48);
+      res.empty_message_fg = bg;
+
+      return res;
+    }
+
+
+    struct terminal_id {
+      dev_t dev;
+      ino_t ino;
+      dev_t rdev;
+      std::string term;
+
+      auto operator<=>(const terminal_id&) const = default;
+    };
+
+
+    terminal_id get_terminal_id(int fd)
+    {
+      struct stat st{};
+      if (::fstat(fd, &st) != 0)
+        st = {};
+      auto term = ::getenv("TERM");
+      return {st.st_dev, st.st_ino, st.st_rdev, term ? term : ""};
+    }
+
+
+    std::mutex terminal_cache_lock;
+    std::map<terminal_id, std::shared_ptr<handle::terminal_entry>> terminal_cache;
+
+
+    // The cache entry for the terminal FD refers to.  The terminal is probed when the entry is first
+    // used.  This takes a round trip to the terminal, the lookups for other terminals do not have
+    // to wait for it.
+    std::shared_ptr<handle::terminal_entry> cached_terminal(int fd)
+    {
+      auto id = get_terminal_id(fd);
+      std::shared_ptr<handle::terminal_entry> e;
+      {
+        std::lock_guard guard(terminal_cache_lock);
+        auto& p = terminal_cache[std::move(id)];
+        if (! p)
+          p = std::make_shared<handle::terminal_entry>();
+        e = p;
+      }
+      std::call_once(e->probed, [&e, fd] { e->info = terminal::info::alloc(fd); });
+      return e;
+    }
+
+
+    // Set the colors of handle S, if possible from the cache.
+    void apply_colors(handle& s)
+    {
+      auto style = std::to_underlying(s.fl & handle::flags::frame);
+      derived_colors c;
+      if (s.term_entry == nullptr)
+        c = compute_colors(*s.info, s.fl);
+      else {
+        std::lock_guard guard(s.term_entry->lock);
+        auto& cached = s.term_entry->colors[style];
+        if (! cached)
+          cached = compute_colors(*s.info, s.fl);
+        c = *cached;
+      }
+
+      if ((s.fl & handle::flags::frame) == handle::flags::frame_background) {
+        s.frame_highlight_fg = c.frame_highlight_fg;
+        s.text_default_fg = c.text_default_fg;
+        s.text_default_bg = c.text_default_bg;
+        s.colsel = std::move(c.colsel);
+      } else {
+        // The text colors might have been set explicitly.
+        s.colsel.clear();
+        if (s.text_default_fg != terminal::info::color{})
+          s.colsel = std::format("\e[38;2;{};{};{};48;2;{};{};{}m", s.text_default_fg.r, s.text_default_fg.g, s.text_default_fg.b, s.text_default_bg.r, s.text_default_bg.g, s.text_default_bg.b);
+      }
+      s.empty_message_fg = c.empty_message_fg;
+    }
+
+
+    // Formatting of control sequences without memory allocation.  Numbers are converted on the
+    // stack and appended to D which, like the output buffer, keeps its capacity.
+    void append_num(std::string& d, size_t n)
+    {
+      std::array<char, 20> buf;
+      auto [end, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), n);
+      d.append(buf.data(), end);
+    }
+
+
+    // CSI N F, for instance for inserting and deleting lines or for scrolling.
+    void csi(std::string& d, size_t n, char f)
+    {
+      d.append("\e[");
+      append_num(d, n);
+      d.push_back(f);
+    }
+
+
+    // Cursor position, CSI ROW;COL H.
+    void csi_pos(std::string& d, size_t row, size_t col)
+    {
+      d.append("\e[");
+      append_num(d, row);
+      d.push_back(';');
+      append_num(d, col);
+      d.push_back('H');
+    }
+
+
+    // SGR sequence setting the foreground color and, if BG is given, the background color.
+    void sgr_color(std::string& d, terminal::info::color fg, const terminal::info::color* bg = nullptr)
+    {
+      d.append("\e[38;2;");
+      append_num(d, fg.r);
+      d.push_back(';');
+      append_num(d, fg.g);
+      d.push_back(';');
+      append_num(d, fg.b);
+      if (bg != nullptr) {
+        d.append(";48;2;");
+        append_num(d, bg->r);
+        d.push_back(';');
+        append_num(d, bg->g);
+        d.push_back(';');
+        append_num(d, bg->b);
+      }
+      d.push_back('m');
+    }
+
+
+    // Append N copies of GLYPH to D, using REP if allowed.
+    void glyph_run(std::string& d, std::string_view glyph, size_t n, bool rep)
+    {
+      if (rep && n > 1) {
+        d.append(glyph);
+        csi(d, n - 1, 'b');
+      } else
+        for (size_t i = 0; i < n; ++i)
+          d.append(glyph);
+    }
+
 
-    std::string cleanup_CSI0m(const std::string& s, const std::string& colsel)
+    // The rendered frame rows for the current settings.
+    const handle::frame_render& frame_rows(handle& s)
     {
-      std::string res;
+      auto& c = s.frame_cache;
+      auto style = s.fl & handle::flags::frame;
+      auto highlight = s.frame_highlight_fg != s.info->default_foreground;
+      if (c.cols != s.term_cols || c.style != style || c.fg != s.frame_highlight_fg || c.highlight != highlight || c.rep != s.rep) {
+        c.cols = s.term_cols;
+        c.style = style;
+        c.fg = s.frame_highlight_fg;
+        c.highlight = highlight;
+        c.rep = s.rep;
+
+        c.color.clear();
+        if (highlight) {
+          c.color.append("\e[m");
+          sgr_color(c.color, s.frame_highlight_fg);
+        }
+        auto line = style == handle::flags::frame_line;
+        c.above.clear();
+        glyph_run(c.above, line ? "─" : "\N{LOWER HALF BLOCK}", s.term_cols, s.rep);
+        c.below.clear();
+        glyph_run(c.below, line ? "─" : "\N{UPPER HALF BLOCK}", s.term_cols, s.rep);
+        c.plain.clear();
+        glyph_run(c.plain, "─", s.term_cols, s.rep);
+      }
+      return c;
+    }
+
 
+    // Append S to RES with each SGR reset replaced by COLSEL.
+    void cleanup_CSI0m(std::string& res, const std::string& s, const std::string& colsel)
+    {
       size_t pos = 0;
       while (true) {
         auto csipos = s.find("\e[", pos);
@@ -184,11 +589,115 @@ namespace nrl {
         } else
           pos = csipos;
       }
+    }
+
+
+    // Add data to the output accumulated for the terminal.
+    void out(handle& s, const std::string_view sv)
+    {
+      s.outbuf.append(sv);
+    }
+
+
+    // Add the buffer content in the range [FROM,TO).
+    void out(handle& s, size_t from, size_t to)
+    {
+      for (auto sv : s.buffer.segments(from, to))
+        s.outbuf.append(sv);
+    }
+
+
+    // The descriptor registered with epoll for the terminal input.  This is the descriptor of
+    // termkey or, with io_uring, the eventfd signaled for completions.
+    int input_fd(const handle& s);
 
+
+    // The data registered with epoll for descriptor FD of the handle.  Handles driven by a reactor
+    // use pointers to their event sources.
+    ::epoll_data_t event_data(handle& s, int fd)
+    {
+      ::epoll_data_t res;
+      if (s.rct == nullptr)
+        res.fd = fd;
+      else {
+        auto& src = fd == input_fd(s) || (s.headless && fd == s.fd) ? s.tk_source : fd == s.resizefd ? s.resize_source : s.compl_source;
+        src.h = &s;
+        src.fd = fd;
+        res.ptr = &src;
+      }
       return res;
     }
 
 
+    void request_output_event(handle& s, bool want)
+    {
+      if (s.want_output != want && s.term_state == state::open) {
+        epoll_event epev;
+        epev.events = EPOLLIN | EPOLLERR;
+        if (want)
+          epev.events |= EPOLLOUT;
+        epev.data = event_data(s, input_fd(s));
+        // Ignore errors.  In the worst case data is written the next time output is flushed.
+        (void) ::epoll_ctl(s.epfd, EPOLL_CTL_MOD, input_fd(s), &epev);
+        s.want_output = want;
+      }
+    }
+
+
+    // With io_uring the output is written asynchronously, see uring_flush.  The completions are
+    // handled by uring_reap.
+    void uring_flush(handle& s, bool wait);
+    bool uring_reap(handle& s);
+
+
+    // Write the accumulated output with a single system call, if possible.  The file descriptor is
+    // in non-blocking mode.  If the terminal does not accept all the data and WAIT is false the rest
+    // is written when the descriptor is writable again.  This is signaled by EPOLLOUT for the
+    // descriptor which in this case is requested.  If WAIT is true or the descriptor is not
+    // registered with epoll the function only returns after all output is written.
+    void flush_output(handle& s, bool wait = false)
+    {
+      if (s.uring) {
+        uring_flush(s, wait);
+        return;
+      }
+
+      while (s.outbuf_written < s.outbuf.size()) {
+        auto n = ::write(s.fd, s.outbuf.data() + s.outbuf_written, s.outbuf.size() - s.outbuf_written);
+        count(s, &handle::statistics::writes);
+        PROBE(write, s.fd, n);
+        if (n >= 0) {
+          s.outbuf_written += n;
+          count(s, &handle::statistics::bytes_written, n);
+        } else if (errno == EAGAIN) {
+          if (! wait && s.term_state == state::open) {
+            request_output_event(s, true);
+            return;
+          }
+          ::pollfd pfd{.fd = s.fd, .events = POLLOUT, .revents = 0};
+          (void) TEMP_FAILURE_RETRY(::poll(&pfd, 1, -1));
+        } else if (errno != EINTR)
+          // The terminal is gone.  There is nothing which can be done with the data.
+          break;
+      }
+
+      s.outbuf.clear();
+      s.outbuf_written = 0;
+      request_output_event(s, false);
+    }
+
+
+    // Let the screen manager insert or delete DELTA lines at the cursor position.  Managers other
+    // than the default one may write to the terminal themselves, the pending output has to be
+    // written first.
+    void adjust_lines(handle& s, int delta)
+    {
+      if (s.scr_mgr != &s.default_scr_mgr)
+        flush_output(s, true);
+      s.scr_mgr->adjust_lines(delta);
+    }
+
+
     std::tuple<unsigned, unsigned> get_current_pos(int fd)
     {
       static const char dsr[] = "\e[6n";
@@ -244,553 +753,2385 @@ namespace nrl {
 
     void move_to_str(std::string& d, handle& s, int x, int y)
     {
-      std::format_to(std::back_inserter(d), "\e[{};{}H", s.initial_row + y, s.initial_col + x);
-    }
-
-
-    auto move_to_buf(char* buf, size_t n, handle& s, int x, int y)
-    {
-      return snprintf(buf, n, "\e[%u;%uH", s.initial_row + y, s.initial_col + x);
+      csi_pos(d, s.initial_row + y, s.initial_col + x);
     }
 
 
     void move_to(handle& s, int x, int y)
     {
-      char buf[40];
-      auto n = move_to_buf(buf, sizeof(buf), s, x, y);
-      ::write(s.fd, buf, n);
+      move_to_str(s.outbuf, s, x, y);
     }
 
 
     std::tuple<unsigned, unsigned> offset_after_n_chars(handle& s, unsigned n, unsigned offset)
     {
+      // No incomplete or invalid character should have been added to the buffer.
+      assert(offset == s.buffer.size() || (s.buffer[offset] & 0xc0) != 0x80);
+      auto start = offset;
       unsigned cnt = 0;
-      while (offset < s.buffer.size() && cnt < n) {
-        assert(s.buffer[offset] < 0x80 || ((s.buffer[offset] & 0xc0) != 0x80 && s.buffer[offset] < 0xf8));
-        if (s.buffer[offset] < 0x80)
-          offset += 1;
-        else if (s.buffer[offset] < 0xe0)
-          offset += 2;
-        else if (s.buffer[offset] < 0xf0)
-          offset += 3;
-        else
-          offset += 4;
-        // No incomplete or invalid character should have been added to the buffer.
-        assert(offset <= s.buffer.size());
-        ++cnt;
+      for (auto sv : s.buffer.segments(offset, s.buffer.size())) {
+        auto [len, c] = advance_chars(reinterpret_cast<const uint8_t*>(sv.data()), sv.size(), n - cnt);
+        offset += len;
+        cnt += c;
+        if (len < sv.size())
+          break;
+      }
+      count(s, &handle::statistics::line_offset_bytes, offset - start);
+      if constexpr (NRL_CHECKS) {
+        size_t o = start;
+        unsigned c = 0;
+        for (; o < s.buffer.size() && c < n; ++c)
+          o = s.buffer.next(o);
+        verify(o == offset && c == cnt, "offset_after_n_chars");
       }
       return {offset, cnt};
     }
 
 
-    void recompute_line_offset(handle& s, int r, size_t startcol)
+    // Whether line breaks can be entered, see handle::line_breaks.
+    bool line_breaks_allowed(const handle& s)
     {
-      unsigned avail = s.term_cols - (r == 0 ? startcol : 0);
-      s.line_offset.resize(r + 1);
-      auto o = s.line_offset[r];
-      while (o < s.buffer.size()) {
-        auto [next, nchars] = offset_after_n_chars(s, avail, o);
+      return s.line_breaks && s.multiline && s.select_options.empty();
+    }
 
-        if (nchars < avail)
-          break;
-        s.line_offset.push_back(next);
-        o = next;
-        avail = s.term_cols;
+
+    // Whether the rows are only ended by wrapping after a fixed number of characters so that the
+    // cursor position can be updated by counting.  Otherwise edits are shown with show_edit and the
+    // cursor is placed with offset_to_pos.
+    bool simple_layout(const handle& s)
+    {
+      return s.logical.size() == 1 && ! s.wide;
+    }
+
+
+    // Width of the character UC in columns.  Characters combining with the previous one and
+    // control characters have no width of their own.
+    unsigned char_width(ucs4_t uc)
+    {
+      return std::max(0, ::uc_width(uc, "UTF-8"));
+    }
+
+
+    // Whether each character of TEXT takes exactly one column and forms a grapheme cluster of its
+    // own.  Characters like regional indicators take one column each but are paired.
+    bool all_narrow(std::string_view text)
+    {
+      auto p = reinterpret_cast<const uint8_t*>(text.data());
+      for (size_t i = 0; i < text.size();) {
+        if (p[i] < 0x80) {
+          ++i;
+          continue;
+        }
+        ucs4_t uc;
+        i += ::u8_mbtouc(&uc, p + i, text.size() - i);
+        if (::uc_width(uc, "UTF-8") != 1 || ::uc_graphemeclusterbreak_property(uc) != GBP_OTHER)
+          return false;
       }
+      return true;
     }
 
 
-    void recompute_line_offset(handle& s, int r)
+    // Switch to the column model, see handle::wide, if TEXT contains a character which does not
+    // take exactly one column.  Only the display with wrapped rows uses the model.
+    void note_width(handle& s, std::string_view text)
     {
-      return recompute_line_offset(s, r, s.prompt_len);
+      if (! s.wide && s.multiline && ! all_narrow(text))
+        s.wide = true;
     }
 
 
-    void show_options(handle& s)
+    // The horizontally scrolled row of single-line mode counts one column per character, it has no
+    // column model.  Text which does not fit this is refused there: the bell rings and the result is
+    // true.
+    bool refuse_wide(handle& s, std::string_view text)
     {
-      auto line_end_str = [&s](size_t i) {
-        if (s.multi) {
-          if (s.selected.contains(i))
-            return "\N{BOX DRAWINGS LIGHT HORIZONTAL}\N{BLACK RIGHT-POINTING TRIANGLE}";
-          return "\N{BOX DRAWINGS LIGHT TRIPLE DASH HORIZONTAL} ";
-        } else
-          return "\N{BOX DRAWINGS LIGHT HORIZONTAL} ";
-      };
+      if (s.multiline || all_narrow(text))
+        return false;
+      out(s, "\a");
+      return true;
+    }
 
-      std::string outs;
-      move_to_str(outs, s, s.prompt_len, 1);
-      if ((s.fl & handle::flags::frame) != handle::flags::none)
-        outs.append("\e[0m");
-      outs.append("\N{BOX DRAWINGS LIGHT VERTICAL}\e[0m\n");
-      for (size_t i = 1; i + 1 < s.select_options.size(); ++i) {
-        move_to_str(outs, s, s.prompt_len, 1 + i);
-        std::format_to(std::back_inserter(outs), "\N{BOX DRAWINGS LIGHT VERTICAL AND RIGHT}{}", line_end_str(i));
-        if (s.select_idx == i)
-          outs.append("\e[7m");
-        outs.append(s.select_options[i]);
-        if (s.select_idx == i)
-          outs.append("\e[27m");
-      }
-      move_to_str(outs, s, s.prompt_len, s.select_options.size());
-      std::format_to(std::back_inserter(outs), "\N{BOX DRAWINGS LIGHT UP AND RIGHT}{}", line_end_str(s.select_options.size() - 1));
-      if (s.select_idx + 1 == s.select_options.size())
-        outs.append("\e[7m");
-      outs.append(s.select_options.back());
-      if (s.select_idx + 1 == s.select_options.size())
-        outs.append("\e[27m");
 
-      if (s.select_idx == 0) {
-        move_to_str(outs, s, s.pos_x, s.pos_y);
-        outs.append("\e[?25h");
-      } else
-        outs.append("\e[?25l");
+    // Copy the N bytes of the buffer starting at FROM, the start of a grapheme cluster, to
+    // handle::cluster_text and find the clusters in them: handle::cluster_breaks[I] is nonzero if
+    // a cluster starts at FROM + I.  The text of the gap buffer is not contiguous and
+    // u8_grapheme_breaks needs the whole sequence to apply the rules with context, regional
+    // indicators are paired for instance.  If FROM + N is not the end of the buffer the last
+    // cluster found might continue.
+    void load_clusters(handle& s, size_t from, size_t n)
+    {
+      s.cluster_text.clear();
+      for (auto sv : s.buffer.segments(from, from + n))
+        s.cluster_text.append(sv);
+      s.cluster_breaks.resize(n);
+      ::u8_grapheme_breaks(reinterpret_cast<const uint8_t*>(s.cluster_text.data()), n, s.cluster_breaks.data());
+    }
 
-      if (! s.colsel.empty() && s.select_idx == 0)
-        outs.append(s.colsel);
 
-      ::write(s.fd, outs.data(), outs.size());
+    // Row containing the buffer offset OFFSET.  The end of the buffer might be at the beginning of
+    // an empty last row.
+    size_t row_at(const handle& s, size_t offset)
+    {
+      auto it = std::ranges::upper_bound(s.line_offset, offset);
+      assert(it != s.line_offset.begin());
+      return std::distance(s.line_offset.begin(), it) - 1;
     }
 
 
-    struct key {
-      bool sym;
-      int mod;
-      long code;
+    // Load the text of row R with load_clusters.  Rows end at cluster boundaries, the last cluster
+    // is complete.
+    void load_row(handle& s, size_t r)
+    {
+      size_t end = r + 1 < s.line_offset.size() ? s.line_offset[r + 1] : s.buffer.size();
+      load_clusters(s, s.line_offset[r], end - s.line_offset[r]);
+    }
 
-      std::strong_ordering operator<=>(const key& k) const
-      {
-        if (k.mod == mod) {
-          if (k.sym == sym)
-            return k.code <=> code;
-          return k.sym <=> sym;
-        } else
-          return k.mod <=> mod;
-      }
-    };
 
-    using key_function = bool (*)(handle&);
+    // End of the loaded grapheme cluster starting at I.
+    size_t cluster_end(const handle& s, size_t i)
+    {
+      auto n = s.cluster_text.size();
+      for (++i; i < n && s.cluster_breaks[i] == 0; ++i)
+        ;
+      return i;
+    }
 
 
-    bool cb_beginning_of_line(handle& s)
+    // Width of the loaded grapheme cluster [I,END), that of its widest character.
+    unsigned cluster_width(const handle& s, size_t i, size_t end)
     {
-      if (s.offset != 0) {
-        s.pos_x = s.prompt_len;
-        s.pos_y = 0;
-        s.offset = 0;
-        move_to(s, s.pos_x, s.pos_y);
+      auto p = reinterpret_cast<const uint8_t*>(s.cluster_text.data());
+      unsigned w = 0;
+      while (i < end) {
+        ucs4_t uc;
+        i += ::u8_mbtouc(&uc, p + i, end - i);
+        w = std::max(w, char_width(uc));
       }
-      return false;
+      return w;
     }
 
 
-    bool cb_end_of_line(handle& s)
+    // End of the grapheme cluster starting at POS.
+    size_t next_cluster(handle& s, size_t pos)
     {
-      if (s.offset != s.buffer.size()) {
-        s.pos_y = s.line_offset.size() - 1;
-        s.requested_pos_x = s.pos_x = (s.pos_y == 0 ? s.prompt_len : 0) + ::u8_strnlen(s.buffer.data() + s.line_offset[s.pos_y], s.buffer.size() - s.line_offset[s.pos_y]);
-        s.offset = s.buffer.size();
-        move_to(s, s.pos_x, s.pos_y);
-      }
-      return false;
+      auto r = row_at(s, pos);
+      load_row(s, r);
+      return s.line_offset[r] + cluster_end(s, pos - s.line_offset[r]);
     }
 
 
-    bool cb_insert(handle& s)
+    // Start of the grapheme cluster ending at POS.
+    size_t prev_cluster(handle& s, size_t pos)
     {
-      s.insert = ! s.insert;
-      return false;
+      auto r = row_at(s, pos - 1);
+      load_row(s, r);
+      auto i = pos - 1 - s.line_offset[r];
+      while (s.cluster_breaks[i] == 0)
+        --i;
+      return s.line_offset[r] + i;
     }
 
 
-    bool cb_enter([[maybe_unused]] handle& s)
+    // Number of columns used by the text of row R before offset TO, a cluster boundary.  The width
+    // of the whole row is known.
+    unsigned ncols(handle& s, size_t r, size_t to)
     {
-      return true;
+      size_t from = s.line_offset[r];
+      size_t end = r + 1 < s.line_offset.size() ? s.line_offset[r + 1] : s.buffer.size();
+      if (s.multiline && (to == end || (to + 1 == end && s.buffer[to] == '\n')))
+        return s.row_cols[r];
+      if (! s.wide)
+        return s.buffer.nchars(from, to);
+      load_clusters(s, from, to - from);
+      unsigned res = 0;
+      for (size_t i = 0, n = to - from; i < n;) {
+        auto e = cluster_end(s, i);
+        res += cluster_width(s, i, e);
+        i = e;
+      }
+      return res;
     }
 
 
-    bool cb_backward_char(handle& s)
+    // Like offset_after_n_chars but for N columns from the start of row R.  Grapheme clusters are
+    // not split, fewer columns than N are used if the next cluster does not fit.  The result does
+    // not extend beyond the row.
+    std::tuple<unsigned, unsigned> offset_after_n_cols(handle& s, unsigned n, size_t r)
     {
-      if (s.offset > 0) {
-        ucs4_t uc;
-        auto prevp = ::u8_prev(&uc, s.buffer.data() + s.offset, s.buffer.data());
-        assert(prevp != nullptr);
-        s.offset = prevp - s.buffer.data();
-        if (s.pos_x == 0) {
-          if (s.multiline) {
-            assert(s.pos_y > 0);
-            s.pos_x = s.term_cols - 1;
-            s.pos_y -= 1;
-          } else {
-          }
-        } else
-          s.pos_x -= 1;
-        s.requested_pos_x = s.pos_x;
-        move_to(s, s.pos_x, s.pos_y);
+      if (! s.wide)
+        return offset_after_n_chars(s, n, s.line_offset[r]);
+      load_row(s, r);
+      unsigned cols = 0;
+      size_t i = 0;
+      while (i < s.cluster_text.size()) {
+        auto e = cluster_end(s, i);
+        auto w = cluster_width(s, i, e);
+        if (cols + w > n)
+          break;
+        cols += w;
+        i = e;
       }
-      return false;
+      return {s.line_offset[r] + i, cols};
     }
 
 
-    bool cb_forward_char(handle& s)
+    // Start of the row following the row starting at O with room for AVAIL characters.  A line
+    // break ends the row early, it is the last byte of the row.  The second value is false if the
+    // row extends to the end of the buffer, the third is true if the row ends with a line break.
+    // The fourth is the number of columns used, the line break takes none.  With the column model
+    // AVAIL is the number of columns and the row also ends early if the next grapheme cluster does
+    // not fit.
+    std::tuple<size_t, bool, bool, unsigned> next_row(handle& s, unsigned avail, size_t o)
     {
-      if (s.offset < s.buffer.size()) {
-        ucs4_t uc;
-        s.offset += ::u8_mbtoucr(&uc, s.buffer.data() + s.offset, s.buffer.size() - s.offset);
-        assert(uc != 0xfffd);
-        if (s.pos_x + 1 == s.term_cols) {
-          if (s.multiline) {
-            assert(s.pos_y < s.line_offset.size());
-            s.pos_x = 0;
-            s.pos_y += 1;
-          } else {
+      if (s.wide) {
+        // Most rows are shorter than a few bytes per column.  The copy ends with a complete
+        // character and is extended when a cluster reaches its end.
+        auto copy_len = [&s, o](size_t n) {
+          n = std::min(n, s.buffer.size() - o);
+          while (o + n < s.buffer.size() && (s.buffer[o + n] & 0xc0) == 0x80)
+            --n;
+          return n;
+        };
+        auto n = copy_len(4 * (avail + 1));
+        load_clusters(s, o, n);
+        unsigned cols = 0;
+        size_t i = 0;
+        while (i < n) {
+          auto e = cluster_end(s, i);
+          if (e == n && o + n < s.buffer.size()) {
+            n = copy_len(2 * n);
+            load_clusters(s, o, n);
+            continue;
           }
-        } else
-          s.pos_x += 1;
-        s.requested_pos_x = s.pos_x;
-        move_to(s, s.pos_x, s.pos_y);
+          auto w = cluster_width(s, i, e);
+          // A cluster wider than any row is shown by itself.
+          if ((cols == avail || cols + w > avail) && (cols > 0 || w <= s.term_cols))
+            return {o + i, true, false, cols};
+          if (s.line_breaks && s.cluster_text[i] == '\n')
+            return {o + i + 1, true, true, cols};
+          cols += w;
+          i = e;
+        }
+        count(s, &handle::statistics::line_offset_bytes, n);
+        return {o + n, cols == avail, false, cols};
       }
-      return false;
+
+      auto [next, nchars] = offset_after_n_chars(s, avail, o);
+      if (s.line_breaks) {
+        auto base = o;
+        for (auto sv : s.buffer.segments(o, next)) {
+          if (auto nl = sv.empty() ? nullptr : static_cast<const char*>(std::memchr(sv.data(), '\n', sv.size())); nl != nullptr) {
+            auto end = base + (nl - sv.data());
+            return {end + 1, true, true, s.buffer.nchars(o, end)};
+          }
+          base += sv.size();
+        }
+      }
+      return {next, nchars == avail, false, nchars};
     }
 
 
-    bool cb_previous_screen_line(handle& s)
+    void recompute_line_offset(handle& s, int r, size_t startcol)
     {
-      if (s.select_idx > 0) {
-        if (s.select_idx > 1 || ! s.select_options.front().empty())
-          --s.select_idx;
-        show_options(s);
-      } else if (s.pos_y > 0) {
-        if (s.pos_y > 1 || s.requested_pos_x >= s.prompt_len) {
-          s.pos_y -= 1;
-          std::tie(s.offset, s.pos_x) = offset_after_n_chars(s, s.requested_pos_x - (s.pos_y == 0 ? s.prompt_len : 0), s.line_offset[s.pos_y]);
-          if (s.pos_y == 0)
-            s.pos_x += s.prompt_len;
-          move_to(s, s.pos_x, s.pos_y);
-        }
+      count(s, &handle::statistics::line_offset_calls);
+      unsigned avail = s.term_cols - (r == 0 ? startcol : 0);
+      s.line_offset.resize(r + 1);
+      s.row_cols.resize(r + 1);
+      s.row_cols[r] = 0;
+      // The logical lines starting after row R are found again.
+      s.logical.resize(std::ranges::upper_bound(s.logical, unsigned(r)) - s.logical.begin());
+      auto o = s.line_offset[r];
+      while (o < s.buffer.size()) {
+        auto [next, complete, hard, cols] = next_row(s, avail, o);
+
+        s.row_cols.back() = cols;
+        if (! complete)
+          break;
+        if (hard)
+          s.logical.push_back(s.line_offset.size());
+        s.line_offset.push_back(next);
+        s.row_cols.push_back(0);
+        o = next;
+        avail = s.term_cols;
       }
-      return false;
     }
 
 
-    bool cb_next_screen_line(handle& s)
+    void recompute_line_offset(handle& s, int r)
     {
-      if (s.pos_y + 1 < s.line_offset.size()) {
-        s.pos_y += 1;
-        s.requested_pos_x = s.pos_x;
-        std::tie(s.offset, s.pos_x) = offset_after_n_chars(s, s.requested_pos_x, s.line_offset[s.pos_y]);
-        move_to(s, s.pos_x, s.pos_y);
-      } else if (s.select_idx + 1 < s.select_options.size()) {
-        ++s.select_idx;
-        show_options(s);
+      return recompute_line_offset(s, r, s.prompt_len);
+    }
+
+
+    // Whether the rules of UAX #29 for extended grapheme clusters allow a break before the code
+    // point CPS[I], I > 0.  The rules are applied to the properties directly so that the reference
+    // does not share the segmentation of u8_grapheme_breaks.
+    bool reference_grapheme_break(const std::vector<ucs4_t>& cps, size_t i)
+    {
+      auto prop = [&cps](size_t j) { return ::uc_graphemeclusterbreak_property(cps[j]); };
+      auto a = prop(i - 1);
+      auto b = prop(i);
+      // GB3 to GB5.
+      if (a == GBP_CR && b == GBP_LF)
+        return false;
+      if (a == GBP_CONTROL || a == GBP_CR || a == GBP_LF || b == GBP_CONTROL || b == GBP_CR || b == GBP_LF)
+        return true;
+      // GB6 to GB8, Hangul syllables.
+      if (a == GBP_L && (b == GBP_L || b == GBP_V || b == GBP_LV || b == GBP_LVT))
+        return false;
+      if ((a == GBP_LV || a == GBP_V) && (b == GBP_V || b == GBP_T))
+        return false;
+      if ((a == GBP_LVT || a == GBP_T) && b == GBP_T)
+        return false;
+      // GB9 to GB9b.
+      if (b == GBP_EXTEND || b == GBP_ZWJ || b == GBP_SPACINGMARK || a == GBP_PREPEND)
+        return false;
+      // GB11, emoji sequences joined by ZWJ.
+      if (a == GBP_ZWJ && ::uc_is_property_extended_pictographic(cps[i])) {
+        auto j = i - 1;
+        while (j > 0 && prop(j - 1) == GBP_EXTEND)
+          --j;
+        if (j > 0 && ::uc_is_property_extended_pictographic(cps[j - 1]))
+          return false;
       }
-      return false;
+      // GB12 and GB13, regional indicators are paired.
+      if (a == GBP_RI && b == GBP_RI) {
+        size_t nri = 0;
+        for (auto j = i; j > 0 && prop(j - 1) == GBP_RI; --j)
+          ++nri;
+        return nri % 2 == 0;
+      }
+      return true;
     }
 
 
-    bool cb_backspace(handle& s)
+    // Reference for the column model: the text is decoded in one piece, split into grapheme
+    // clusters with reference_grapheme_break, and each cluster is placed in turn.  A cluster which
+    // does not fit starts a new row unless it is wider than any row.  The columns used by each row
+    // are added to WIDTHS.
+    void wide_line_offset_reference(handle& s, std::vector<unsigned>& rows, std::vector<unsigned>& logical, std::vector<unsigned>& widths)
     {
-      if (s.offset > 0) {
-        auto old_offset = s.offset;
-        (void) cb_backward_char(s);
-        assert(s.offset != old_offset);
-        s.buffer.erase(s.buffer.begin() + s.offset, s.buffer.begin() + old_offset);
-        recompute_line_offset(s, s.pos_y);
-        char movbuf[40];
-        size_t nmovbuf = move_to_buf(movbuf, sizeof(movbuf), s, s.pos_x, s.pos_y);
-        // clang-format off
-        std::array<iovec, 5> iov
-        {
-          { {s.buffer.data() + s.offset, s.buffer.size() - s.offset},
-            {const_cast<char*>(" "), 1},
-          }
-        };
-        // clang-format on
-        size_t niov = 2;
-        if (s.line_offset.size() < s.max_lines) {
-          assert(s.line_offset.size() + 1 == s.max_lines);
-          iov[niov++] = {const_cast<char*>("\n\e[m\e[M"), 7};
-          s.max_lines -= 1;
-          if (! s.colsel.empty())
-            iov[niov++] = {s.colsel.data(), s.colsel.size()};
+      std::string text;
+      for (auto sv : s.buffer.segments(0, s.buffer.size()))
+        text.append(sv);
+      auto p = reinterpret_cast<const uint8_t*>(text.data());
+      std::vector<ucs4_t> cps;
+      std::vector<size_t> starts;
+      for (size_t o = 0; o < text.size();) {
+        ucs4_t uc;
+        starts.push_back(o);
+        o += ::u8_mbtouc(&uc, p + o, text.size() - o);
+        cps.push_back(uc);
+      }
+      starts.push_back(text.size());
+
+      unsigned avail = s.term_cols - s.prompt_len;
+      unsigned cols = 0;
+      size_t k = 0;
+      while (k < cps.size()) {
+        auto o = starts[k];
+        auto w = char_width(cps[k]);
+        auto end = k + 1;
+        for (; end < cps.size() && ! reference_grapheme_break(cps, end); ++end)
+          w = std::max(w, char_width(cps[end]));
+
+        if ((cols == avail || cols + w > avail) && (cols > 0 || w <= s.term_cols)) {
+          rows.push_back(o);
+          widths.push_back(cols);
+          cols = 0;
+          avail = s.term_cols;
         }
-        iov[niov++] = {movbuf, nmovbuf};
-        ::writev(s.fd, iov.data(), niov);
-        s.requested_pos_x = s.pos_x;
+        if (s.line_breaks && p[o] == '\n') {
+          logical.push_back(rows.size());
+          rows.push_back(o + 1);
+          widths.push_back(cols);
+          cols = 0;
+          avail = s.term_cols;
+        } else
+          cols += w;
+        k = end;
       }
-      return false;
+      if (cols == avail) {
+        rows.push_back(text.size());
+        widths.push_back(cols);
+        cols = 0;
+      }
+      widths.push_back(cols);
     }
 
 
-    bool cb_delete(handle& s)
+    // Compare the line starts computed incrementally with those found by looking at each
+    // character of the buffer.
+    void verify_line_offset(handle& s)
     {
-      if (s.offset < s.buffer.size()) {
-        ucs4_t _;
-        auto n = ::u8_mbtoucr(&_, s.buffer.data() + s.offset, s.buffer.size() - s.offset);
-        assert(n > 0);
-        s.buffer.erase(s.buffer.begin() + s.offset, s.buffer.begin() + s.offset + n);
-        recompute_line_offset(s, s.pos_y);
-        char movbuf[40];
-        size_t nmovbuf = move_to_buf(movbuf, sizeof(movbuf), s, s.pos_x, s.pos_y);
-        // clang-format off
-        std::array<iovec, 5> iov
-        {
-          { {s.buffer.data() + s.offset, s.buffer.size() - s.offset},
-            {const_cast<char*>(" "), 1},
-          }
-        };
-        // clang-format on
-        size_t niov = 2;
-        if (s.line_offset.size() < s.max_lines) {
-          assert(s.line_offset.size() + 1 == s.max_lines);
-          iov[niov++] = {const_cast<char*>("\n\e[m\e[M"), 7};
-          s.max_lines -= 1;
-          if (! s.colsel.empty())
-            iov[niov++] = {s.colsel.data(), s.colsel.size()};
+      std::vector<unsigned> rows{0};
+      std::vector<unsigned> logical{0};
+      std::vector<unsigned> widths;
+      if (s.wide) {
+        wide_line_offset_reference(s, rows, logical, widths);
+        verify(rows == s.line_offset && logical == s.logical && widths == s.row_cols, "recompute_line_offset");
+        return;
+      }
+      unsigned avail = s.term_cols - s.prompt_len;
+      unsigned n = 0;
+      size_t o = 0;
+      while (o < s.buffer.size()) {
+        if (n == avail) {
+          rows.push_back(o);
+          widths.push_back(n);
+          n = 0;
+          avail = s.term_cols;
+          continue;
         }
-        iov[niov++] = {movbuf, nmovbuf};
-        ::writev(s.fd, iov.data(), niov);
-        s.requested_pos_x = s.pos_x;
+        auto nl = s.line_breaks && s.buffer[o] == '\n';
+        o = s.buffer.next(o);
+        if (nl) {
+          logical.push_back(rows.size());
+          rows.push_back(o);
+          widths.push_back(n);
+          n = 0;
+          avail = s.term_cols;
+        } else
+          ++n;
       }
-      return false;
+      if (n == avail) {
+        rows.push_back(o);
+        widths.push_back(n);
+        n = 0;
+      }
+      widths.push_back(n);
+      verify(rows == s.line_offset && logical == s.logical && widths == s.row_cols, "recompute_line_offset");
     }
 
 
-    bool cb_backward_word(handle& s)
+    // Description of a modification of the buffer.  END is the offset after the modified region in
+    // the new buffer, NBYTES and NCHARS are the change of the buffer size in bytes and characters.
+    struct line_edit {
+      size_t end;
+      ptrdiff_t nbytes;
+      ptrdiff_t nchars;
+    };
+
+
+    // Set the widths of the rows starting with row FROM for simple_layout: all rows but the last
+    // are full, the last uses LAST columns.
+    void fill_row_cols(handle& s, size_t from, unsigned last)
     {
-      if (s.offset > 0) {
-        auto cat = uc_general_category_or(UC_LETTER, UC_NUMBER);
-        ucs4_t uc1;
-        auto p = ::u8_prev(&uc1, s.buffer.data() + s.offset, s.buffer.data());
-        while (p > s.buffer.data()) {
-          ucs4_t uc2;
-          auto q = ::u8_prev(&uc2, p, s.buffer.data());
-          if (::uc_is_general_category(uc1, cat) && ! ::uc_is_general_category(uc2, cat))
-            break;
-          p = q;
-          uc1 = uc2;
+      auto n = s.line_offset.size();
+      s.row_cols.resize(n);
+      for (auto j = from; j + 1 < n; ++j)
+        s.row_cols[j] = s.term_cols - (j == 0 ? s.prompt_len : 0);
+      s.row_cols[n - 1] = last;
+    }
+
+
+    // Recompute the line starts after row R following the modification E.  Lines are wrapped after a
+    // fixed number of characters which means the character positions at which lines start are the
+    // same before and after the change.  The start of lines following the modified region can
+    // therefore be derived from the old start, shifted by the byte delta and moved by the number of
+    // added or removed characters.  For changes of a row or more the old start of the row that many
+    // rows earlier (or later) is used so that never more than a row's worth of characters has to be
+    // stepped over.  Only the lines containing the modification and the last line are actually
+    // rescanned.
+    void recompute_line_offset(handle& s, unsigned r, const line_edit& e)
+    {
+      count(s, &handle::statistics::line_offset_calls);
+      auto old_nlines = s.line_offset.size();
+      // The rows before the old last row and before row R were full and remain so.
+      auto fill_from = std::min<size_t>(r, old_nlines - 1);
+      // Row J now starts where the old row J - SHIFT started, moved by REM characters.
+      auto cols = ptrdiff_t(s.term_cols);
+      auto shift = e.nchars / cols;
+      auto rem = e.nchars - shift * cols;
+      // The entries for the earlier rows are overwritten before they are needed.
+      if (shift > 0)
+        s.rows_scratch.assign(s.line_offset.begin(), s.line_offset.end());
+      const auto& old = shift > 0 ? s.rows_scratch : s.line_offset;
+      unsigned avail = s.term_cols - (r == 0 ? s.prompt_len : 0);
+      auto o = s.line_offset[r];
+      do {
+        auto [next, nchars] = offset_after_n_chars(s, avail, o);
+        if (nchars < avail) {
+          s.line_offset.resize(r + 1);
+          fill_row_cols(s, fill_from, nchars);
+          return;
         }
+        ++r;
+        if (r < old_nlines)
+          s.line_offset[r] = next;
+        else
+          s.line_offset.push_back(next);
+        o = next;
+        avail = s.term_cols;
+      } while (o < e.end);
+
+      // The old values of the following entries are still present.  The first row is wrapped
+      // differently, the relationship only holds for the later rows.
+      for (auto j = r + 1; ; ++j) {
+        auto src = ptrdiff_t(j) - shift;
+        if (src < 1 || size_t(src) >= old_nlines)
+          break;
+        size_t cand = old[src] + e.nbytes;
+        if (cand < e.end || cand > s.buffer.size())
+          break;
+        ptrdiff_t n = rem;
+        for (; n > 0 && cand > e.end; --n)
+          cand = s.buffer.prev(cand);
+        for (; n < 0 && cand < s.buffer.size(); ++n)
+          cand = s.buffer.next(cand);
+        if (n != 0 || cand < e.end)
+          break;
+        if (j < s.line_offset.size())
+          s.line_offset[j] = cand;
+        else
+          s.line_offset.push_back(cand);
+        o = cand;
+        r = j;
+      }
+      s.line_offset.resize(r + 1);
 
-        s.offset = p - s.buffer.data();
-        while (s.line_offset[s.pos_y] > s.offset) {
-          assert(s.pos_y > 0);
-          --s.pos_y;
+      // Determine whether the last line is complete.
+      unsigned last = 0;
+      while (o < s.buffer.size()) {
+        auto [next, nchars] = offset_after_n_chars(s, avail, o);
+
+        if (nchars < avail) {
+          last = nchars;
+          break;
         }
-        s.pos_x = ::u8_mbsnlen(s.buffer.data() + s.line_offset[s.pos_y], s.offset - s.line_offset[s.pos_y]);
-        if (s.pos_y == 0)
-          s.pos_x += s.prompt_len;
-        s.requested_pos_x = s.pos_x;
-        move_to(s, s.pos_x, s.pos_y);
+        s.line_offset.push_back(next);
+        o = next;
       }
-      return false;
+      fill_row_cols(s, fill_from, last);
+
+      if constexpr (NRL_CHECKS)
+        verify_line_offset(s);
     }
 
 
-    bool cb_forward_word(handle& s)
+    // Rows replaced by rewrap(): the NOLD rows starting with row FIRST are now NNEW rows.
+    struct row_change {
+      size_t first;
+      size_t nold;
+      size_t nnew;
+    };
+
+
+    // Recompute the line starts after the modification E for a buffer with line breaks or for the
+    // column model.  R is the row containing the start of the modification.  The logical lines
+    // which begin after the modified region keep their wrapping, their rows are only moved.  Only
+    // the rows of the logical lines touched by the modification are scanned again and only until a
+    // row starts with the same text as an old row: the rest of the logical line is wrapped as before.
+    row_change rewrap(handle& s, size_t r, const line_edit& e)
     {
-      if (s.offset + 1 < s.buffer.size()) {
-        auto cat = uc_general_category_or(UC_LETTER, UC_NUMBER);
-        ucs4_t uc1;
-        auto p = ::u8_next(&uc1, s.buffer.data() + s.offset);
-        if (p < s.buffer.data() + s.buffer.size()) {
-          auto q = ::u8_next(&uc1, p);
-          while (q <= s.buffer.data() + s.buffer.size()) {
-            if (q == s.buffer.data() + s.buffer.size()) {
-              p = q;
-              break;
-            }
-            ucs4_t uc2;
-            auto r = ::u8_next(&uc2, q);
-            if (::uc_is_general_category(uc1, cat) && ! ::uc_is_general_category(uc2, cat)) {
-              p = q;
-              break;
-            }
-            p = q;
-            q = r;
-            uc1 = uc2;
+      count(s, &handle::statistics::line_offset_calls);
+      // With the column model a row can end early because the following cluster does not fit.  The
+      // previous row can then change as well.
+      if (s.wide && r > 0 && ! std::ranges::binary_search(s.logical, unsigned(r)))
+        --r;
+      auto old_nrows = s.line_offset.size();
+      size_t old_end = e.end - e.nbytes;
+      // The first logical line which only moves.
+      auto moved = std::ranges::upper_bound(s.logical, old_end, {}, [&s](unsigned row) { return size_t(s.line_offset[row]); }) - s.logical.begin();
+      size_t keep = size_t(moved) < s.logical.size() ? s.logical[moved] : old_nrows;
+      size_t stop = keep < old_nrows ? s.line_offset[keep] + e.nbytes : s.buffer.size();
+
+      auto& rows = s.rows_scratch;
+      rows.clear();
+      // The widths of the rows starting with row R.
+      auto& widths = s.row_cols_scratch;
+      widths.clear();
+      unsigned avail = s.term_cols - (r == 0 ? s.prompt_len : 0);
+      size_t o = s.line_offset[r];
+      // Old row compared with the rows after the modification.
+      auto cand = r + 1;
+      auto resync = false;
+      while (o < s.buffer.size()) {
+        auto [next, complete, hard, cols] = next_row(s, avail, o);
+        widths.push_back(cols);
+        if (! complete || (keep < old_nrows && next == stop))
+          break;
+        if (next >= e.end) {
+          while (cand < keep && ptrdiff_t(s.line_offset[cand]) + e.nbytes < ptrdiff_t(next))
+            ++cand;
+          if (cand < keep && s.line_offset[cand] >= old_end && ptrdiff_t(s.line_offset[cand]) + e.nbytes == ptrdiff_t(next)) {
+            keep = cand;
+            resync = true;
+            break;
           }
         }
-
-        s.offset = p - s.buffer.data();
-        while (s.pos_y + 1 < s.line_offset.size() && s.offset >= s.line_offset[s.pos_y + 1])
-          ++s.pos_y;
-        s.pos_x = ::u8_mbsnlen(s.buffer.data() + s.line_offset[s.pos_y], s.offset - s.line_offset[s.pos_y]);
-        if (s.pos_y == 0)
-          s.pos_x += s.prompt_len;
-        s.requested_pos_x = s.pos_x;
-        move_to(s, s.pos_x, s.pos_y);
+        rows.push_back(next);
+        o = next;
+        avail = s.term_cols;
       }
-      return false;
+      // The empty row at the end of the buffer.
+      if (widths.size() == rows.size())
+        widths.push_back(0);
+
+      for (auto j = keep; j < old_nrows; ++j)
+        s.line_offset[j] += e.nbytes;
+      s.line_offset.erase(s.line_offset.begin() + r + 1, s.line_offset.begin() + keep);
+      s.line_offset.insert(s.line_offset.begin() + r + 1, rows.begin(), rows.end());
+      s.row_cols.erase(s.row_cols.begin() + r, s.row_cols.begin() + keep);
+      s.row_cols.insert(s.row_cols.begin() + r, widths.begin(), widths.end());
+
+      // Entries up to row R remain, those of the moved lines are shifted, those in between found again.
+      ptrdiff_t delta = ptrdiff_t(rows.size()) - ptrdiff_t(keep - r - 1);
+      for (auto k = size_t(moved); k < s.logical.size(); ++k)
+        s.logical[k] += delta;
+      auto pos = std::ranges::upper_bound(s.logical, unsigned(r)) - s.logical.begin();
+      s.logical.erase(s.logical.begin() + pos, s.logical.begin() + moved);
+      // The row at which the old wrapping is used again might start a logical line as well.
+      for (size_t k = r + 1; k <= r + rows.size() + resync; ++k)
+        // With the column model the first row is empty if the first cluster does not fit.
+        if (s.line_offset[k] > s.line_offset[k - 1] && s.buffer[s.line_offset[k] - 1] == '\n')
+          s.logical.insert(s.logical.begin() + pos++, k);
+
+      if constexpr (NRL_CHECKS)
+        verify_line_offset(s);
+      return {r, keep - r, rows.size() + 1};
     }
 
 
-    void redisplay(handle& s, bool final = false)
+    // Determine the screen row and the column for the buffer offset OFFSET.
+    std::tuple<unsigned, unsigned> offset_to_pos(handle& s, size_t offset)
     {
-      std::string answer_str;
-      if (final && std::holds_alternative<std::monostate>(s.answer)) {
-        if (std::holds_alternative<std::string>(s.answer))
-          answer_str = std::get<std::string>(s.answer);
-        else
-          answer_str = std::get<handle::string_callback>(s.answer)();
-      }
+      unsigned row = row_at(s, offset);
+      unsigned col = ncols(s, row, offset) + (row == 0 ? s.prompt_len : 0);
+      return {col, row};
+    }
 
-      [[maybe_unused]] auto old_nlines = s.line_offset.size();
-      s.pos_x = final ? 0 : s.prompt_len;
-      s.pos_y = 0;
-      recompute_line_offset(s, 0, answer_str.empty() ? s.prompt_len : nonescape_len(answer_str));
-      // clang-format off
-      char movbuf[40];
-      size_t nmovbuf = move_to_buf(movbuf, sizeof(movbuf), s, s.pos_x, s.pos_y);
-      std::array<iovec, 7> iov
-      {
-        {{movbuf, nmovbuf}},
-      };
-      // clang-format on
-      size_t niov = 1;
-      iov[niov++] = {answer_str.data(), answer_str.size()};
-      if (! answer_str.empty())
-        iov[niov++] = {answer_str.data(), answer_str.size()};
-      iov[niov++] = {s.buffer.data(), s.buffer.size()};
-      iov[niov++] = {const_cast<char*>("\e[K"), 3};
-      std::string clear;
-      if (s.max_lines > s.line_offset.size()) {
-        clear = std::format("\n\e[m\e[{}M", s.max_lines - s.line_offset.size());
-        iov[niov++] = {clear.data(), clear.size()};
-        if (! s.colsel.empty())
-          iov[niov++] = {s.colsel.data(), s.colsel.size()};
-        s.max_lines = s.line_offset.size();
-      } else
-        assert(old_nlines == s.line_offset.size());
-      iov[niov++] = {movbuf, nmovbuf};
-      ::writev(s.fd, iov.data(), niov);
+
+    // Number of entries in the menu including the input field.  If the options are filtered only
+    // the matches are shown.
+    size_t menu_size(const handle& s)
+    {
+      return s.filtered ? 1 + s.matches.size() : s.select_options.size();
     }
 
 
-    bool cb_unix_line_discard(handle& s)
+    // Index in SELECT_OPTIONS of the option shown at position POS of the menu.
+    size_t option_at(const handle& s, size_t pos)
     {
-      if (s.offset > 0) {
-        s.buffer.erase(s.buffer.begin(), s.buffer.begin() + s.offset);
-        s.offset = 0;
-        redisplay(s);
-      }
-      return false;
+      return s.filtered && pos > 0 ? s.matches[pos - 1] : pos;
     }
 
 
-    bool cb_kill_line(handle& s)
+    // Number of rows the options menu occupies below the buffer, including the connecting row.
+    size_t menu_rows(const handle& s)
     {
-      if (s.offset < s.buffer.size()) {
-        s.buffer.erase(s.buffer.begin() + s.offset, s.buffer.end());
-        auto old_nlines = s.line_offset.size();
-        recompute_line_offset(s, s.pos_y);
-        // clang-format off
-        std::array<iovec, 3> iov
-        {
-          {{const_cast<char*>("\e[K"), 3},}
-        };
-        // clang-format on
-        size_t niov = 1;
-        std::string clear;
-        if (s.max_lines > s.line_offset.size()) {
-          clear = std::format("\n\e[m\e[{}M{}", s.max_lines - s.line_offset.size(), s.colsel);
-          iov[niov++] = {clear.data(), clear.size()};
-          char movbuf[40];
-          size_t nmovbuf = move_to_buf(movbuf, sizeof(movbuf), s, s.pos_x, s.pos_y);
-          iov[niov++] = {movbuf, nmovbuf};
-          s.max_lines = s.line_offset.size();
-        } else
-          assert(old_nlines == s.line_offset.size());
-        ::writev(s.fd, iov.data(), niov);
-      }
-      return false;
+      return s.select_options.size() > 1 ? 1 + s.menu_height : s.select_options.size();
     }
 
 
-    void show_empty_message(handle& s, std::string& msg)
+    // Determine how many options are shown at once.  Besides the menu only ROWS_USED rows are
+    // needed on the screen.
+    void set_menu_height(handle& s, size_t rows_used)
+    {
+      auto avail = s.term_rows > rows_used + 1 ? s.term_rows - rows_used - 1 : 1zu;
+      s.menu_height = std::min(s.select_options.size() - 1, avail);
+      s.menu_first = std::max(1zu, std::min(s.select_idx, s.select_options.size() - s.menu_height));
+    }
+
+
+    // Draw the row of the menu entry at position I which must be visible in the menu window.
+    void show_option_row(handle& s, size_t i)
     {
-      std::string coloff;
-      if (! s.colsel.empty())
-        coloff = s.colsel;
+      auto& outs = s.outbuf;
+      move_to_str(outs, s, s.prompt_len, s.max_lines + 1 + (i - s.menu_first));
+      outs.append(i + 1 == menu_size(s) ? "\N{BOX DRAWINGS LIGHT UP AND RIGHT}" : "\N{BOX DRAWINGS LIGHT VERTICAL AND RIGHT}");
+      if (s.multi)
+        outs.append(s.selected.contains(option_at(s, i)) ? "\N{BOX DRAWINGS LIGHT HORIZONTAL}\N{BLACK RIGHT-POINTING TRIANGLE}" : "\N{BOX DRAWINGS LIGHT TRIPLE DASH HORIZONTAL} ");
       else
-        coloff = "\e[m";
+        outs.append("\N{BOX DRAWINGS LIGHT HORIZONTAL} ");
+      if (s.select_idx == i)
+        outs.append("\e[7m");
+      outs.append(s.select_options[option_at(s, i)]);
+      if (s.select_idx == i)
+        outs.append("\e[27m");
+      // Remove what was shown before in the row.
+      outs.append("\e[K");
+    }
 
-      if (msg.empty()) {
-        ::write(s.fd, coloff.data(), coloff.size());
-        return;
+
+    // Place or hide the cursor after the menu has been drawn.
+    void finish_options(handle& s)
+    {
+      auto& outs = s.outbuf;
+      if (s.select_idx == 0 || s.filter) {
+        // While filtering the input field stays active.
+        move_to_str(outs, s, s.pos_x, s.pos_y);
+        outs.append("\e[?25h");
+      } else
+        outs.append("\e[?25l");
+
+      if (! s.colsel.empty() && (s.select_idx == 0 || s.filter))
+        outs.append(s.colsel);
+    }
+
+
+    // Draw the visible window of the options menu.  Only MENU_HEIGHT entries starting at
+    // MENU_FIRST are shown.  An arrow in the connecting row indicates hidden entries above.
+    void show_options(handle& s)
+    {
+      auto& outs = s.outbuf;
+      move_to_str(outs, s, s.prompt_len, s.max_lines);
+      if ((s.fl & handle::flags::frame) != handle::flags::none)
+        outs.append("\e[0m");
+      outs.append(s.menu_first > 1 ? "\N{UPWARDS ARROW}\e[0m" : "\N{BOX DRAWINGS LIGHT VERTICAL}\e[0m");
+      auto nshown = std::min(s.menu_height, menu_size(s) - 1);
+      for (size_t i = s.menu_first; i < s.menu_first + nshown; ++i)
+        show_option_row(s, i);
+      // Rows not needed because of filtering are cleared.
+      for (auto r = nshown; r < s.menu_height; ++r) {
+        move_to_str(outs, s, s.prompt_len, s.max_lines + 1 + r);
+        outs.append("\e[K");
       }
 
-      auto colon = std::format("\e[38;2;{};{};{};48;2;{};{};{}m", s.empty_message_fg.r, s.empty_message_fg.g, s.empty_message_fg.b, s.text_default_bg.r, s.text_default_bg.g, s.text_default_bg.b);
-      char movebuf[40];
-      auto nmovebuf = move_to_buf(movebuf, sizeof(movebuf), s, s.pos_x, s.pos_y);
-      // clang-format off
-      std::array<iovec, 4> iov{
-        {
-          {colon.data(), colon.size()},
-          {msg.data(), msg.size()},
-          {coloff.data(), coloff.size()},
-          {movebuf, static_cast<size_t>(nmovebuf) }},
-      };
-      // clang-format on
-      ::writev(s.fd, iov.data(), iov.size());
+      finish_options(s);
     }
 
 
-    // clang-format off
-    std::map<key, key_function> key_map{
-      {{false, ::TERMKEY_KEYMOD_CTRL, 'a'}, cb_beginning_of_line},
-      {{true, 0, ::TERMKEY_SYM_HOME}, cb_beginning_of_line},
-      {{false, ::TERMKEY_KEYMOD_CTRL, 'e'}, cb_end_of_line},
-      {{true, 0, ::TERMKEY_SYM_END}, cb_end_of_line},
-      {{true, 0, ::TERMKEY_SYM_INSERT}, cb_insert},
-      {{true, 0, ::TERMKEY_SYM_ENTER}, cb_enter},
-      {{true, 0, ::TERMKEY_SYM_LEFT}, cb_backward_char},
-      {{true, 0, ::TERMKEY_SYM_RIGHT}, cb_forward_char},
-      {{true, 0, ::TERMKEY_SYM_UP}, cb_previous_screen_line},
-      {{true, 0, ::TERMKEY_SYM_DOWN}, cb_next_screen_line},
-      {{true, 0, ::TERMKEY_SYM_BACKSPACE}, cb_backspace},
-      {{true, 0, ::TERMKEY_SYM_DELETE}, cb_delete},
-      {{false, ::TERMKEY_KEYMOD_ALT, 'b'}, cb_backward_word},
-      {{false, ::TERMKEY_KEYMOD_ALT, 'f'}, cb_forward_word},
-      {{false, ::TERMKEY_KEYMOD_CTRL, 'u'}, cb_unix_line_discard},
-      {{false, ::TERMKEY_KEYMOD_CTRL, 'k'}, cb_kill_line},
-    };
-    // clang-format on
+    // Move the highlight to option IDX, zero meaning the input field.  If the option is visible
+    // only the two affected rows are redrawn, otherwise the window is moved.
+    void select_option(handle& s, size_t idx)
+    {
+      auto old = s.select_idx;
+      s.select_idx = idx;
+      if (idx > 0 && (idx < s.menu_first || idx >= s.menu_first + s.menu_height)) {
+        s.menu_first = idx < s.menu_first ? idx : idx + 1 - s.menu_height;
+        show_options(s);
+        return;
+      }
 
+      if (old > 0 && old != idx)
+        show_option_row(s, old);
+      if (idx > 0)
+        show_option_row(s, idx);
+      finish_options(s);
+    }
 
-    bool on_key(handle& s, ::TermKeyKey key)
+
+    // Lowercase version of the ASCII byte B, other bytes are unchanged.
+    constexpr char filter_fold(char b)
     {
-      if (key.type == ::TERMKEY_TYPE_UNICODE) {
-        if ((key.modifiers & (::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_CTRL)) == 0) {
-          assert(s.offset <= s.buffer.size());
+      return b >= 'A' && b <= 'Z' ? b - 'A' + 'a' : b;
+    }
 
-          // If selections are available and the current selection is not the input field,
-          // ignore the key stroke except if multi-select is available and SPACE is pressed.
-          if (s.select_idx > 0) {
-            if (s.multi) {
-              if (s.selected.contains((s.select_idx)))
-                s.selected.erase(s.select_idx);
-              else
-                s.selected.insert(s.select_idx);
-              show_options(s);
-            }
 
-            return false;
-          }
+    // Bit mask of the characters occurring in a string, used to quickly reject candidates.
+    // Letters and digits have their own bits, all other bytes share the remaining ones.
+    constexpr uint64_t filter_mask(std::string_view sv)
+    {
+      uint64_t res = 0;
+      for (unsigned char b : sv)
+        res |= uint64_t(1) << (b >= 'a' && b <= 'z' ? b - 'a' : b >= '0' && b <= '9' ? 26 + b - '0' : 36 + b % 28);
+      return res;
+    }
 
 
-          uint8_t buf[8];
-          auto l = ::u8_uctomb(buf, key.code.codepoint, sizeof(buf));
-          auto to_print = l;
+    // Build the index used for filtering the options: the lowercased options stored back to back
+    // and the masks of the characters in each option.
+    void build_filter_index(handle& s)
+    {
+      s.filter_lower.clear();
+      s.filter_starts.clear();
+      s.filter_masks.clear();
+      for (const auto& o : s.select_options) {
+        s.filter_starts.push_back(s.filter_lower.size());
+        auto start = s.filter_lower.size();
+        std::ranges::transform(o, std::back_inserter(s.filter_lower), filter_fold);
+        s.filter_masks.push_back(filter_mask(std::string_view(s.filter_lower).substr(start)));
+      }
+      s.filter_starts.push_back(s.filter_lower.size());
+    }
 
-          if (s.buffer.empty() && ! s.empty_message.empty())
-            ::write(s.fd, "\e[K", 3);
 
-          if (s.insert || s.offset == s.buffer.size()) {
-            s.buffer.insert(s.buffer.begin() + s.offset, buf, buf + l);
+    // Score of the match of the query Q as a subsequence of candidate C or -1 if there is no match.
+    // The characters are searched with memchr which the C library implements with vector
+    // instructions.  Consecutive matches and matches at the beginning of words are preferred,
+    // gaps and long candidates are penalized.
+    int filter_score(std::string_view c, std::string_view q)
+    {
+      int score = 0;
+      const char* prev = nullptr;
+      auto cur = c.data();
+      auto end = c.data() + c.size();
+      for (char ch : q) {
+        auto m = static_cast<const char*>(std::memchr(cur, ch, end - cur));
+        if (m == nullptr)
+          return -1;
+        score += 16;
+        if (prev != nullptr && m == prev + 1)
+          score += 24;
+        else {
+          if (m == c.data() || ! std::isalnum(static_cast<unsigned char>(m[-1])))
+            score += 12;
+          if (prev != nullptr)
+            score -= std::min<int>(m - prev - 1, 8);
+        }
+        prev = m;
+        cur = m + 1;
+      }
+      return score - std::min<int>(c.size() - q.size(), 32) / 4;
+    }
 
-            if (s.multiline) {
-              // Recompute the affected line starts.
+
+    // Filter the options with the text of the buffer.  If the query got longer the previous
+    // matches are a superset of the new matches and only they have to be tested.
+    void refilter(handle& s)
+    {
+      s.filter_changes = s.buffer.changes();
+      auto& query = s.scratch;
+      query.clear();
+      std::ranges::transform(s.buffer.view(), std::back_inserter(query), filter_fold);
+
+      if (query.empty())
+        s.filtered = false;
+      else {
+        auto qmask = filter_mask(query);
+        s.filter_scratch.clear();
+        auto test = [&s, &query, qmask](uint32_t i) {
+          if ((s.filter_masks[i] & qmask) == qmask)
+            if (auto sc = filter_score(std::string_view(s.filter_lower).substr(s.filter_starts[i], s.filter_starts[i + 1] - s.filter_starts[i]), query); sc >= 0)
+              s.filter_scratch.emplace_back(-sc, i);
+        };
+        if (s.filtered && query.starts_with(s.filter_query))
+          std::ranges::for_each(s.matches, test);
+        else
+          for (uint32_t i = 1; i < s.select_options.size(); ++i)
+            test(i);
+        std::ranges::sort(s.filter_scratch);
+
+        s.matches.clear();
+        for (auto [sc, i] : s.filter_scratch)
+          s.matches.push_back(i);
+        s.filtered = true;
+      }
+      // Swapping keeps the memory of both strings.
+      s.filter_query.swap(query);
+
+      // Highlight the best match.  Without query start as prepare() does.
+      if (s.filtered)
+        s.select_idx = menu_size(s) > 1 ? 1 : 0;
+      else
+        s.select_idx = s.select_options.front().empty() ? 1 : 0;
+      s.menu_first = 1;
+      show_options(s);
+    }
+
+
+    void place_cursor(handle& s);
+    size_t logical_line(const handle& s, size_t r);
+    std::tuple<size_t, size_t> logical_range(const handle& s, size_t l);
+
+
+    bool cb_beginning_of_line(handle& s)
+    {
+      if (! simple_layout(s)) {
+        // Start of the logical line.
+        s.offset = std::get<0>(logical_range(s, logical_line(s, s.pos_y)));
+        place_cursor(s);
+      } else if (s.offset != 0) {
+        s.pos_x = s.prompt_len;
+        s.pos_y = 0;
+        s.offset = 0;
+        move_to(s, s.pos_x, s.pos_y);
+      }
+      return false;
+    }
+
+
+    bool cb_end_of_line(handle& s)
+    {
+      if (! simple_layout(s)) {
+        s.offset = std::get<1>(logical_range(s, logical_line(s, s.pos_y)));
+        place_cursor(s);
+      } else if (s.offset != s.buffer.size()) {
+        s.pos_y = s.line_offset.size() - 1;
+        s.requested_pos_x = s.pos_x = (s.pos_y == 0 ? s.prompt_len : 0) + s.buffer.nchars(s.line_offset[s.pos_y], s.buffer.size());
+        s.offset = s.buffer.size();
+        move_to(s, s.pos_x, s.pos_y);
+      }
+      return false;
+    }
+
+
+    bool cb_insert(handle& s)
+    {
+      s.insert = ! s.insert;
+      return false;
+    }
+
+
+    bool cb_newline(handle& s);
+
+
+    bool cb_enter(handle& s)
+    {
+      if (s.input_complete != nullptr && line_breaks_allowed(s) && ! s.input_complete(s, s.buffer.view()))
+        return cb_newline(s);
+      return true;
+    }
+
+
+    bool cb_backward_char(handle& s)
+    {
+      if (s.offset > 0) {
+        s.offset = s.wide ? prev_cluster(s, s.offset) : s.buffer.prev(s.offset);
+        if (! simple_layout(s))
+          std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+        else if (s.pos_x == 0) {
+          if (s.multiline) {
+            assert(s.pos_y > 0);
+            s.pos_x = s.term_cols - 1;
+            s.pos_y -= 1;
+          } else {
+          }
+        } else
+          s.pos_x -= 1;
+        s.requested_pos_x = s.pos_x;
+        move_to(s, s.pos_x, s.pos_y);
+      }
+      return false;
+    }
+
+
+    bool cb_forward_char(handle& s)
+    {
+      if (s.offset < s.buffer.size()) {
+        assert(s.buffer.get(s.offset) != 0xfffd);
+        s.offset = s.wide ? next_cluster(s, s.offset) : s.buffer.next(s.offset);
+        if (! simple_layout(s))
+          std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+        else if (s.pos_x + 1 == s.term_cols) {
+          if (s.multiline) {
+            assert(s.pos_y < s.line_offset.size());
+            s.pos_x = 0;
+            s.pos_y += 1;
+          } else {
+          }
+        } else
+          s.pos_x += 1;
+        s.requested_pos_x = s.pos_x;
+        move_to(s, s.pos_x, s.pos_y);
+      }
+      return false;
+    }
+
+
+    // At the first and last row the history is used, see below.
+    bool cb_history_previous(handle& s);
+    bool cb_history_next(handle& s);
+
+
+    size_t row_end(const handle& s, size_t r);
+
+
+    // The cursor cannot be placed after the line break ending the row POS_Y.  POS_X does not
+    // include the prompt.
+    void clamp_to_row(handle& s)
+    {
+      if (auto end = row_end(s, s.pos_y); s.offset > end) {
+        s.pos_x = ncols(s, s.pos_y, end);
+        s.offset = end;
+      }
+    }
+
+
+    bool cb_previous_screen_line(handle& s)
+    {
+      if (s.select_idx > 0) {
+        if (s.select_idx > 1 || ! s.select_options.front().empty())
+          select_option(s, s.select_idx - 1);
+      } else if (s.pos_y > 0) {
+        if (s.pos_y > 1 || s.requested_pos_x >= s.prompt_len) {
+          s.pos_y -= 1;
+          std::tie(s.offset, s.pos_x) = offset_after_n_cols(s, s.requested_pos_x - (s.pos_y == 0 ? s.prompt_len : 0), s.pos_y);
+          clamp_to_row(s);
+          if (s.pos_y == 0)
+            s.pos_x += s.prompt_len;
+          move_to(s, s.pos_x, s.pos_y);
+        }
+      } else
+        return cb_history_previous(s);
+      return false;
+    }
+
+
+    bool cb_next_screen_line(handle& s)
+    {
+      if (s.pos_y + 1 < s.line_offset.size()) {
+        s.pos_y += 1;
+        s.requested_pos_x = s.pos_x;
+        std::tie(s.offset, s.pos_x) = offset_after_n_cols(s, s.requested_pos_x, s.pos_y);
+        clamp_to_row(s);
+        move_to(s, s.pos_x, s.pos_y);
+      } else if (s.select_idx + 1 < menu_size(s))
+        select_option(s, s.select_idx + 1);
+      else
+        return cb_history_next(s);
+      return false;
+    }
+
+
+    // End of the text shown in row R, without the line break ending it.
+    size_t row_end(const handle& s, size_t r)
+    {
+      if (r + 1 == s.line_offset.size())
+        return s.buffer.size();
+      size_t end = s.line_offset[r + 1];
+      return end > s.line_offset[r] && s.buffer[end - 1] == '\n' ? end - 1 : end;
+    }
+
+
+    // Record in the screen model that rows FROM to TO (exclusive, default all remaining rows) now
+    // show the content of the buffer.  In single-line mode the visible part is a horizontally
+    // scrolled window which is not modeled.
+    void sync_shadow(handle& s, size_t from, size_t to = std::numeric_limits<size_t>::max())
+    {
+      to = std::min(to, s.line_offset.size());
+      if (! s.multiline || (s.shadow.empty() && (from > 0 || to < s.line_offset.size()))) {
+        // Without a complete model nothing is known.
+        s.shadow.clear();
+        return;
+      }
+
+      s.shadow.resize(s.line_offset.size());
+      for (auto r = from; r < to; ++r) {
+        auto segs = s.buffer.segments(s.line_offset[r], row_end(s, r));
+        s.shadow[r].assign(segs[0]);
+        s.shadow[r].append(segs[1]);
+      }
+    }
+
+
+    // Bring the highlighting information of all rows up to date.  The text of each row is compared
+    // with the cached text, rows are only highlighted again if the text or the state at the end
+    // of the previous row changed.
+    void update_highlight(handle& s)
+    {
+      s.hl_rows.resize(s.line_offset.size());
+      unsigned state = 0;
+      for (size_t r = 0; r < s.line_offset.size(); ++r) {
+        auto& e = s.hl_rows[r];
+        auto segs = s.buffer.segments(s.line_offset[r], row_end(s, r));
+        if (e.start_state != state || e.text.size() != segs[0].size() + segs[1].size() || ! e.text.starts_with(segs[0]) || ! e.text.ends_with(segs[1])) {
+          e.text.assign(segs[0]);
+          e.text.append(segs[1]);
+          e.start_state = state;
+          // The old spans are kept in HL_SPANS for the comparison.  Swapping reuses the memory.
+          e.spans.swap(s.hl_spans);
+          e.spans.clear();
+          e.end_state = s.highlighter(s, e.text, state, e.spans);
+          e.dirty = e.dirty || e.spans != s.hl_spans;
+        }
+        state = e.end_state;
+      }
+    }
+
+
+    // Write the bytes [FROM+I,TO) of row R, using the styles of the highlighter, if any.
+    void out_row(handle& s, size_t r, size_t from, size_t i, size_t to)
+    {
+      if (s.highlighter == nullptr) {
+        out(s, from + i, to);
+        return;
+      }
+
+      const std::string_view coloff = s.colsel.empty() ? std::string_view("\e[m") : std::string_view(s.colsel);
+      auto& e = s.hl_rows[r];
+      auto p = i;
+      for (const auto& sp : e.spans) {
+        // Spans reaching beyond the end of the row are cut off.
+        auto a = std::max<size_t>(sp.from, p);
+        auto b = std::min<size_t>(sp.to, to - from);
+        if (a >= b)
+          continue;
+        if (a > p)
+          out(s, from + p, from + a);
+        // Only the foreground is changed so that the background of COLSEL remains.
+        sgr_color(s.outbuf, sp.fg);
+        if (sp.bold)
+          out(s, "\e[1m");
+        out(s, from + a, from + b);
+        // COLSEL only selects the colors, it does not end bold text.
+        if (sp.bold && ! s.colsel.empty())
+          out(s, "\e[22m");
+        out(s, coloff);
+        p = b;
+      }
+      if (from + p < to)
+        out(s, from + p, to);
+      e.dirty = false;
+    }
+
+
+    // Bring row R of the screen up to date using the screen model.  Only the part starting with
+    // the first changed character is written.  If a highlighter is used update_highlight must
+    // have been called.
+    void update_row(handle& s, size_t r)
+    {
+      size_t from = s.line_offset[r];
+      auto to = row_end(s, r);
+      auto n = to - from;
+      auto is_new = r >= s.shadow.size();
+      std::string_view old = is_new ? std::string_view() : std::string_view(s.shadow[r]);
+
+      size_t i = 0;
+      if (s.highlighter == nullptr || ! s.hl_rows[r].dirty)
+        while (i < n && i < old.size() && s.buffer[from + i] == uint8_t(old[i]))
+          ++i;
+      if (! is_new && i == n && i == old.size())
+        return;
+      // Do not start in the middle of a character.
+      while (i > 0 && i < n && (s.buffer[from + i] & 0xc0) == 0x80)
+        --i;
+      auto col = r == 0 ? s.prompt_len : 0;
+      // With the column model the old width is not known.  Only a row which is not full is cleared.
+      bool clear;
+      if (s.wide) {
+        // Nor after a grapheme cluster which might have been extended or cut short.  Only the
+        // clusters before it are measured.
+        load_clusters(s, from, i);
+        size_t c = 0;
+        unsigned before = 0;
+        for (size_t j = 0; j < i;) {
+          auto e = cluster_end(s, j);
+          if (e < i) {
+            c = e;
+            before += cluster_width(s, j, e);
+          }
+          j = e;
+        }
+        i = c;
+        clear = col + s.row_cols[r] < s.term_cols;
+        col += before;
+      } else {
+        clear = s.buffer.nchars(from + i, to) < count_chars(reinterpret_cast<const uint8_t*>(old.data()) + i, old.size() - i);
+        col += s.buffer.nchars(from, from + i);
+      }
+
+      move_to(s, col, r);
+      out_row(s, r, from, i, to);
+      if (is_new || clear)
+        out(s, "\e[K");
+    }
+
+
+    // Show the highlighted rows starting with row FROM after a modification of the buffer.
+    void refresh_rows(handle& s, size_t from)
+    {
+      update_highlight(s);
+      if (s.shadow.empty())
+        from = 0;
+      for (auto r = from; r < s.line_offset.size(); ++r)
+        update_row(s, r);
+      sync_shadow(s, from);
+    }
+
+
+    // Record in the undo journal that the NREMOVE bytes at OFFSET are replaced by the concatenation
+    // of the two pieces of INSERTED.  This must happen before the buffer is modified.  CURSOR is the
+    // cursor position before the edit.  Typed characters (TYPED true) are added to the previous
+    // record if it is for the text typed immediately before.
+    void record_edit(handle& s, size_t offset, size_t nremove, const std::array<std::string_view, 2>& inserted, size_t cursor, bool typed = false)
+    {
+      auto ninserted = inserted[0].size() + inserted[1].size();
+
+      // An edit after undo discards the records which could be redone.
+      if (s.journal_pos < s.journal.size()) {
+        s.journal.resize(s.journal_pos);
+        s.journal_text.resize(s.journal.empty() ? 0 : s.journal.back().text + s.journal.back().nremoved + s.journal.back().ninserted);
+      }
+
+      // The records use 32-bit offsets and lengths.  An edit which cannot be described this way
+      // discards the journal since the older records cannot be undone without it.
+      constexpr size_t limit = std::numeric_limits<uint32_t>::max();
+      if (s.buffer.size() + ninserted > limit || s.journal_text.size() + nremove + ninserted > limit) [[unlikely]] {
+        s.journal.clear();
+        s.journal_text.clear();
+        s.journal_pos = 0;
+        return;
+      }
+
+      if (typed && nremove == 0 && ! s.journal.empty()) {
+        auto& last = s.journal.back();
+        if (last.typed && last.nremoved == 0 && last.offset + last.ninserted == offset) {
+          s.journal_text.append(inserted[0]);
+          s.journal_text.append(inserted[1]);
+          last.ninserted += ninserted;
+          return;
+        }
+      }
+
+      handle::edit_record rec{uint32_t(offset), uint32_t(s.journal_text.size()), uint32_t(nremove), uint32_t(ninserted), uint32_t(cursor), typed && nremove == 0};
+      for (auto sv : s.buffer.segments(offset, offset + nremove))
+        s.journal_text.append(sv);
+      s.journal_text.append(inserted[0]);
+      s.journal_text.append(inserted[1]);
+      s.journal.push_back(rec);
+      s.journal_pos = s.journal.size();
+    }
+
+
+    void erase_text(handle& s, size_t from, size_t to);
+
+
+    bool cb_backspace(handle& s)
+    {
+      if (s.offset > 0) {
+        auto old_offset = s.offset;
+        (void) cb_backward_char(s);
+        assert(s.offset != old_offset);
+        auto nbytes = old_offset - s.offset;
+        if (! simple_layout(s)) {
+          s.offset = old_offset;
+          erase_text(s, old_offset - nbytes, old_offset);
+          return false;
+        }
+        record_edit(s, s.offset, nbytes, {}, old_offset);
+        s.buffer.erase(s.offset, old_offset);
+        recompute_line_offset(s, s.pos_y, {s.offset, -ptrdiff_t(nbytes), -1});
+        if (s.highlighter != nullptr && s.multiline) {
+          refresh_rows(s, s.pos_y);
+          move_to(s, 0, s.line_offset.size());
+        } else {
+          out(s, s.offset, s.buffer.size());
+          out(s, " ");
+          sync_shadow(s, s.pos_y);
+          if (s.line_offset.size() < s.max_lines)
+            out(s, "\n");
+        }
+        if (s.line_offset.size() < s.max_lines) {
+          assert(s.line_offset.size() + 1 == s.max_lines);
+          out(s, "\e[m\e[M");
+          s.max_lines -= 1;
+          out(s, s.colsel);
+        }
+        move_to(s, s.pos_x, s.pos_y);
+        s.requested_pos_x = s.pos_x;
+      }
+      return false;
+    }
+
+
+    bool cb_delete(handle& s)
+    {
+      if (s.offset < s.buffer.size()) {
+        auto next = s.wide ? next_cluster(s, s.offset) : s.buffer.next(s.offset);
+        if (! simple_layout(s)) {
+          erase_text(s, s.offset, next);
+          return false;
+        }
+        record_edit(s, s.offset, next - s.offset, {}, s.offset);
+        s.buffer.erase(s.offset, next);
+        recompute_line_offset(s, s.pos_y, {s.offset, -ptrdiff_t(next - s.offset), -1});
+        if (s.highlighter != nullptr && s.multiline) {
+          refresh_rows(s, s.pos_y);
+          move_to(s, 0, s.line_offset.size());
+        } else {
+          out(s, s.offset, s.buffer.size());
+          out(s, " ");
+          sync_shadow(s, s.pos_y);
+          if (s.line_offset.size() < s.max_lines)
+            out(s, "\n");
+        }
+        if (s.line_offset.size() < s.max_lines) {
+          assert(s.line_offset.size() + 1 == s.max_lines);
+          out(s, "\e[m\e[M");
+          s.max_lines -= 1;
+          out(s, s.colsel);
+        }
+        move_to(s, s.pos_x, s.pos_y);
+        s.requested_pos_x = s.pos_x;
+      }
+      return false;
+    }
+
+
+    // Start of the word before the cursor.  Words are made of letters and digits.
+    size_t backward_word_start(const handle& s)
+    {
+      auto cat = uc_general_category_or(UC_LETTER, UC_NUMBER);
+      auto p = s.buffer.prev(s.offset);
+      ucs4_t uc1 = s.buffer.get(p);
+      while (p > 0) {
+        auto q = s.buffer.prev(p);
+        ucs4_t uc2 = s.buffer.get(q);
+        if (::uc_is_general_category(uc1, cat) && ! ::uc_is_general_category(uc2, cat))
+          break;
+        p = q;
+        uc1 = uc2;
+      }
+      return p;
+    }
+
+
+    bool cb_backward_word(handle& s)
+    {
+      if (s.offset > 0) {
+        s.offset = backward_word_start(s);
+        std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+        s.requested_pos_x = s.pos_x;
+        move_to(s, s.pos_x, s.pos_y);
+      }
+      return false;
+    }
+
+
+    // End of the word after the cursor.
+    size_t forward_word_end(const handle& s)
+    {
+      auto cat = uc_general_category_or(UC_LETTER, UC_NUMBER);
+      auto p = s.buffer.next(s.offset);
+      if (p < s.buffer.size()) {
+        ucs4_t uc1 = s.buffer.get(p);
+        auto q = s.buffer.next(p);
+        while (q <= s.buffer.size()) {
+          if (q == s.buffer.size()) {
+            p = q;
+            break;
+          }
+          ucs4_t uc2 = s.buffer.get(q);
+          auto r = s.buffer.next(q);
+          if (::uc_is_general_category(uc1, cat) && ! ::uc_is_general_category(uc2, cat)) {
+            p = q;
+            break;
+          }
+          p = q;
+          q = r;
+          uc1 = uc2;
+        }
+      }
+      return p;
+    }
+
+
+    bool cb_forward_word(handle& s)
+    {
+      if (s.offset + 1 < s.buffer.size()) {
+        s.offset = forward_word_end(s);
+        std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+        s.requested_pos_x = s.pos_x;
+        move_to(s, s.pos_x, s.pos_y);
+      }
+      return false;
+    }
+
+
+    void out_text(handle& s, size_t startcol);
+
+
+    void redisplay(handle& s, bool final = false)
+    {
+      count(s, &handle::statistics::redisplays);
+      std::string answer_str;
+      if (final && std::holds_alternative<std::monostate>(s.answer)) {
+        if (std::holds_alternative<std::string>(s.answer))
+          answer_str = std::get<std::string>(s.answer);
+        else
+          answer_str = std::get<handle::string_callback>(s.answer)();
+      }
+
+      [[maybe_unused]] auto old_nlines = s.line_offset.size();
+      s.pos_x = final ? 0 : s.prompt_len;
+      s.pos_y = 0;
+      auto startcol = answer_str.empty() ? s.prompt_len : nonescape_len(answer_str);
+      recompute_line_offset(s, 0, startcol);
+      if (answer_str.empty() && (! s.shadow.empty() || (s.highlighter != nullptr && s.multiline))) {
+        // Only repaint what changed.
+        if (s.highlighter != nullptr)
+          update_highlight(s);
+        for (size_t r = 0; r < s.line_offset.size(); ++r)
+          update_row(s, r);
+        if (s.max_lines > s.line_offset.size())
+          move_to(s, 0, s.line_offset.size());
+      } else {
+        move_to(s, s.pos_x, s.pos_y);
+        out(s, answer_str);
+        out_text(s, startcol);
+        out(s, "\e[K");
+        if (s.max_lines > s.line_offset.size())
+          out(s, "\n");
+      }
+      if (s.max_lines > s.line_offset.size()) {
+        out(s, "\e[m");
+        csi(s.outbuf, s.max_lines - s.line_offset.size(), 'M');
+        out(s, s.colsel);
+        s.max_lines = s.line_offset.size();
+      } else
+        assert(old_nlines == s.line_offset.size());
+      if (answer_str.empty())
+        sync_shadow(s, 0);
+      else
+        s.shadow.clear();
+      move_to(s, s.pos_x, s.pos_y);
+    }
+
+
+    // Insert DELTA empty lines before row AT.  If necessary the screen content is scrolled up first.
+    void insert_rows(handle& s, size_t at, size_t delta)
+    {
+      auto bottom = s.initial_row + s.max_lines + delta - 1 + s.cur_frame_lines;
+      if (bottom > s.term_rows) {
+        // The first line cannot be moved beyond the top of the screen.
+        auto nscroll = std::min<size_t>(bottom - s.term_rows, s.initial_row - 1 - s.cur_frame_lines);
+        if (nscroll > 0) {
+          csi(s.outbuf, nscroll, 'S');
+          s.initial_row -= nscroll;
+        }
+      }
+      move_to(s, 0, at);
+      csi(s.outbuf, delta, 'L');
+      s.max_lines += delta;
+    }
+
+
+    // Make sure the screen has room for all lines of the buffer.  Lines are inserted after the
+    // last line used so far.
+    void make_room(handle& s)
+    {
+      if (s.line_offset.size() > s.max_lines)
+        insert_rows(s, s.max_lines, s.line_offset.size() - s.max_lines);
+    }
+
+
+    // Show the buffer with line breaks after the modification E which starts in row R.  The rows of
+    // the logical lines following the modification are moved on the screen by inserting or deleting
+    // lines, they do not have to be repainted.  The screen model and the highlighting cache are
+    // moved the same way.
+    void show_edit(handle& s, size_t r, const line_edit& e)
+    {
+      auto [first, nold, nnew] = rewrap(s, r, e);
+      auto at = first + std::min(nold, nnew);
+      if (nnew > nold) {
+        insert_rows(s, at, nnew - nold);
+        if (! s.shadow.empty())
+          s.shadow.insert(s.shadow.begin() + at, nnew - nold, std::string());
+        if (s.hl_rows.size() > at)
+          s.hl_rows.insert(s.hl_rows.begin() + at, nnew - nold, handle::highlight_row());
+      } else if (nold > nnew) {
+        move_to(s, 0, at);
+        out(s, "\e[m");
+        csi(s.outbuf, nold - nnew, 'M');
+        out(s, s.colsel);
+        s.max_lines -= nold - nnew;
+        if (s.shadow.size() > at)
+          s.shadow.erase(s.shadow.begin() + at, s.shadow.begin() + std::min(s.shadow.size(), first + nold));
+        if (s.hl_rows.size() > at)
+          s.hl_rows.erase(s.hl_rows.begin() + at, s.hl_rows.begin() + std::min(s.hl_rows.size(), first + nold));
+      }
+      make_room(s);
+
+      size_t to = first + nnew;
+      auto known = ! s.shadow.empty();
+      if (! known) {
+        first = 0;
+        to = s.line_offset.size();
+      }
+      if (s.highlighter != nullptr)
+        update_highlight(s);
+      for (auto row = first; row < s.line_offset.size(); ++row)
+        // The highlighting of later rows can change as well.
+        if (row < to || (s.highlighter != nullptr && s.hl_rows[row].dirty)) {
+          update_row(s, row);
+          if (known)
+            sync_shadow(s, row, row + 1);
+        }
+      if (! known)
+        sync_shadow(s, 0);
+    }
+
+
+    // Show the cursor at the position of the current offset.
+    void place_cursor(handle& s)
+    {
+      std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+      s.requested_pos_x = s.pos_x;
+      move_to(s, s.pos_x, s.pos_y);
+    }
+
+
+    // Write the whole buffer at the current position, the first row starts in column STARTCOL.
+    // Line breaks and, with the column model, rows which are not full move to the start of the
+    // next row.
+    void out_text(handle& s, size_t startcol)
+    {
+      if (simple_layout(s)) {
+        out(s, 0, s.buffer.size());
+        return;
+      }
+
+      for (size_t r = 0; r < s.line_offset.size(); ++r) {
+        auto end = row_end(s, r);
+        out(s, s.line_offset[r], end);
+        if (r + 1 < s.line_offset.size() && (end < s.line_offset[r + 1] || (s.wide && (r == 0 ? startcol : 0) + ncols(s, r, end) < s.term_cols))) {
+          // The row is not full.
+          out(s, "\e[K");
+          move_to(s, 0, r + 1);
+        }
+      }
+    }
+
+
+    // Remove the bytes [FROM,TO) from a buffer with line breaks and show the result.
+    void erase_text(handle& s, size_t from, size_t to)
+    {
+      auto row = row_at(s, from);
+      record_edit(s, from, to - from, {}, s.offset);
+      s.buffer.erase(from, to);
+      show_edit(s, row, {from, -ptrdiff_t(to - from), 0});
+      s.offset = from;
+      place_cursor(s);
+    }
+
+
+    // The logical line shown in row R.
+    size_t logical_line(const handle& s, size_t r)
+    {
+      return std::ranges::upper_bound(s.logical, unsigned(r)) - s.logical.begin() - 1;
+    }
+
+
+    // Offsets of the start and the end, before the line break, of logical line L.
+    std::tuple<size_t, size_t> logical_range(const handle& s, size_t l)
+    {
+      return {s.line_offset[s.logical[l]], l + 1 < s.logical.size() ? s.line_offset[s.logical[l + 1]] - 1 : s.buffer.size()};
+    }
+
+
+    // Recognize the markers of bracketed paste, CSI 200~ and CSI 201~, which are reported as unknown
+    // CSI sequences.  Returns true if KEY is such a marker.  In this case key.code.number is set
+    // to paste_start or paste_end.  The key can then be handled later without having to call
+    // termkey_interpret_csi.  termkey never reports these values as commands since they are no
+    // valid final bytes.
+    constexpr int paste_start = 200;
+    constexpr int paste_end = 201;
+
+    bool paste_marker(handle& s, ::TermKeyKey& key)
+    {
+      std::array<long, 2> args;
+      size_t nargs = args.size();
+      unsigned long cmd;
+      if (::termkey_interpret_csi(s.tk, &key, args.data(), &nargs, &cmd) != ::TERMKEY_RES_KEY || cmd != '~' || nargs != 1 || (args[0] != paste_start && args[0] != paste_end))
+        return false;
+      key.code.number = args[0];
+      return true;
+    }
+
+
+    // The mark of a predictor, CSI 5150;N~, and its answer, see nrl::predictor.
+    constexpr int echo_mark = 5150;
+    constexpr char predict_left = '\1';
+    constexpr char predict_right = '\2';
+
+    // Answer the mark with serial number TOKEN.  Predictions are only allowed when the key strokes
+    // are shown by the simple code paths of on_key and the cursor motion functions.
+    void echo_hint(handle& s, long token)
+    {
+      unsigned left = 0;
+      unsigned right = 0;
+      unsigned room = 0;
+      if (s.multiline && simple_layout(s) && s.select_options.empty() && s.highlighter == nullptr && ! s.searching && ! s.completing && ! s.pasting && (! s.buffer.empty() || s.empty_message.empty())) {
+        auto start = s.pos_y == 0 ? s.prompt_len : 0;
+        left = s.pos_x - start;
+        // The cursor must not reach the last column, it then moves to the next row.
+        right = std::min<size_t>(s.row_cols[s.pos_y] - left, s.term_cols - 1 - s.pos_x);
+        if (s.offset == s.buffer.size() && s.pos_x + 1 < s.term_cols)
+          room = s.term_cols - 1 - s.pos_x;
+      }
+
+      out(s, "\e]");
+      append_num(s.outbuf, echo_mark);
+      for (size_t n : {size_t(token), size_t(s.initial_row + s.pos_y), size_t(s.initial_col + s.pos_x), size_t(left), size_t(right), size_t(room)}) {
+        s.outbuf.push_back(';');
+        append_num(s.outbuf, n);
+      }
+      out(s, "\a");
+    }
+
+
+    // Recognize the mark of a predictor.  Returns true if KEY is such a mark which is then answered,
+    // if requested.  Before the position of the cursor is known there is nothing to tell.
+    bool echo_marker(handle& s, ::TermKeyKey& key)
+    {
+      std::array<long, 2> args;
+      size_t nargs = args.size();
+      unsigned long cmd;
+      if (::termkey_interpret_csi(s.tk, &key, args.data(), &nargs, &cmd) != ::TERMKEY_RES_KEY || cmd != '~' || nargs != 2 || args[0] != echo_mark)
+        return false;
+      if (s.echo_hints && ! s.awaiting_pos)
+        echo_hint(s, args[1]);
+      return true;
+    }
+
+
+    void add_to_paste(handle& s, const ::TermKeyKey& key)
+    {
+      std::string_view add;
+      if (key.type == ::TERMKEY_TYPE_UNICODE && (key.modifiers & (::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_CTRL)) == 0)
+        add = key.utf8;
+      else if (line_breaks_allowed(s) && ((key.type == ::TERMKEY_TYPE_KEYSYM && key.code.sym == ::TERMKEY_SYM_ENTER) || (key.type == ::TERMKEY_TYPE_UNICODE && key.modifiers == ::TERMKEY_KEYMOD_CTRL && key.code.codepoint == 'j')))
+        add = "\n";
+      else if ((key.type == ::TERMKEY_TYPE_KEYSYM && (key.code.sym == ::TERMKEY_SYM_ENTER || key.code.sym == ::TERMKEY_SYM_TAB)) || (key.type == ::TERMKEY_TYPE_UNICODE && key.modifiers == ::TERMKEY_KEYMOD_CTRL && (key.code.codepoint == 'j' || key.code.codepoint == 'i')))
+        // Without line breaks the buffer contains a single logical line.  Line breaks and tabs are
+        // mapped to spaces.
+        add = " ";
+      else
+        // Other keys are dropped.
+        return;
+
+      if (s.paste.size() + add.size() <= s.max_paste)
+        s.paste.append(add);
+    }
+
+
+    // Show the input without multiline after the text before the cursor at OFFSET grew.  The text
+    // stays in a single row.  If the cursor gets too close to the right edge the shown part starts
+    // later, as in on_key, and the hidden text is marked with «.
+    void show_single_row(handle& s)
+    {
+      s.line_offset.resize(1);
+      s.row_cols.resize(1);
+      auto limit = std::max(1u, unsigned(0.9 * s.term_cols));
+      auto startcol = s.line_offset[0] == 0 ? s.prompt_len : 1u;
+      if (s.initial_col + startcol + s.buffer.nchars(s.line_offset[0], s.offset) > limit) {
+        auto first = s.offset;
+        for (unsigned n = 1; s.initial_col + n < limit && first > 0; ++n)
+          first = s.buffer.prev(first);
+        s.line_offset[0] = first;
+        startcol = 1;
+      }
+
+      if (s.line_offset[0] > 0) {
+        move_to(s, 0, 0);
+        out(s, "«");
+      } else
+        move_to(s, startcol, 0);
+      auto [end, nchars] = offset_after_n_chars(s, s.term_cols - startcol, s.line_offset[0]);
+      out(s, s.line_offset[0], end);
+      out(s, "\e[K");
+      sync_shadow(s, 0);
+
+      s.pos_x = startcol + s.buffer.nchars(s.line_offset[0], s.offset);
+      s.pos_y = 0;
+      s.requested_pos_x = s.pos_x;
+      move_to(s, s.pos_x, s.pos_y);
+    }
+
+
+    // Insert the collected pasted text at the cursor position and show the result.  In overwrite
+    // mode the text replaces as many characters, line breaks are not overwritten.
+    void finish_paste(handle& s)
+    {
+      if (s.select_idx == 0 && ! s.paste.empty() && ! refuse_wide(s, s.paste)) {
+        auto nchars = ptrdiff_t(count_chars(reinterpret_cast<const uint8_t*>(s.paste.data()), s.paste.size()));
+        auto old_end = s.offset;
+        if (! s.insert)
+          for (auto n = nchars; n > 0 && old_end < s.buffer.size() && s.buffer[old_end] != '\n'; --n)
+            old_end = s.buffer.next(old_end);
+        auto nremove = old_end - s.offset;
+        auto end = s.offset + s.paste.size();
+        line_edit e{end, ptrdiff_t(s.paste.size()) - ptrdiff_t(nremove), nchars - ptrdiff_t(s.buffer.nchars(s.offset, old_end))};
+        record_edit(s, s.offset, nremove, {s.paste}, s.offset);
+        s.buffer.erase(s.offset, old_end);
+        s.buffer.insert(s.offset, s.paste);
+        note_width(s, s.paste);
+        s.offset = end;
+
+        if (! s.multiline)
+          show_single_row(s);
+        else {
+          if (! simple_layout(s) || s.paste.contains('\n'))
+            show_edit(s, s.pos_y, e);
+          else {
+            recompute_line_offset(s, s.pos_y, e);
+            make_room(s);
+            redisplay(s);
+          }
+
+          std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+          s.requested_pos_x = s.pos_x;
+          move_to(s, s.pos_x, s.pos_y);
+        }
+      }
+
+      s.paste.clear();
+      s.pasting = false;
+    }
+
+
+    // Save the text in the range [FROM,TO) in the kill ring.  Directly following kills are
+    // collected in one entry.  BEFORE is true for text before the cursor.
+    void kill_text(handle& s, size_t from, size_t to, bool before)
+    {
+      auto append = s.kill_serial + 1 == s.key_serial;
+      auto segs = s.buffer.segments(from, to);
+      if (before) {
+        s.kills->add(segs[1], append, true);
+        s.kills->add(segs[0], true, true);
+      } else {
+        s.kills->add(segs[0], append);
+        s.kills->add(segs[1], true);
+      }
+      s.kill_serial = s.key_serial;
+    }
+
+
+    bool cb_unix_line_discard(handle& s)
+    {
+      if (! simple_layout(s)) {
+        // Only the text of the logical line is removed.
+        auto start = std::get<0>(logical_range(s, logical_line(s, s.pos_y)));
+        if (start < s.offset) {
+          kill_text(s, start, s.offset, true);
+          erase_text(s, start, s.offset);
+        }
+      } else if (s.offset > 0) {
+        kill_text(s, 0, s.offset, true);
+        record_edit(s, 0, s.offset, {}, s.offset);
+        s.buffer.erase(0, s.offset);
+        s.offset = 0;
+        redisplay(s);
+      }
+      return false;
+    }
+
+
+    bool cb_kill_line(handle& s)
+    {
+      if (! simple_layout(s)) {
+        // Kill the rest of the logical line or, at its end, the line break.
+        auto end = std::get<1>(logical_range(s, logical_line(s, s.pos_y)));
+        if (end == s.offset && end < s.buffer.size())
+          ++end;
+        if (end > s.offset) {
+          kill_text(s, s.offset, end, false);
+          erase_text(s, s.offset, end);
+        }
+      } else if (s.offset < s.buffer.size()) {
+        kill_text(s, s.offset, s.buffer.size(), false);
+        record_edit(s, s.offset, s.buffer.size() - s.offset, {}, s.offset);
+        s.buffer.erase(s.offset, s.buffer.size());
+        auto old_nlines = s.line_offset.size();
+        recompute_line_offset(s, s.pos_y);
+        if (s.highlighter != nullptr && s.multiline) {
+          refresh_rows(s, s.pos_y);
+          move_to(s, 0, s.line_offset.size());
+        } else {
+          out(s, "\e[K");
+          sync_shadow(s, s.pos_y);
+          if (s.max_lines > s.line_offset.size())
+            out(s, "\n");
+        }
+        if (s.max_lines > s.line_offset.size()) {
+          out(s, "\e[m");
+          csi(s.outbuf, s.max_lines - s.line_offset.size(), 'M');
+          out(s, s.colsel);
+          move_to(s, s.pos_x, s.pos_y);
+          s.max_lines = s.line_offset.size();
+        } else
+          assert(old_nlines == s.line_offset.size());
+      }
+      return false;
+    }
+
+
+    void show_empty_message(handle& s, std::string& msg)
+    {
+      const std::string_view coloff = s.colsel.empty() ? std::string_view("\e[m") : std::string_view(s.colsel);
+
+      if (msg.empty()) {
+        out(s, coloff);
+        return;
+      }
+
+      // The message is not part of the screen model.
+      s.shadow.clear();
+
+      sgr_color(s.outbuf, s.empty_message_fg, &s.text_default_bg);
+      out(s, msg);
+      out(s, coloff);
+      move_to(s, s.pos_x, s.pos_y);
+    }
+
+
+    // Replace the content of the buffer with TEXT and place the cursor at offset CURSOR.
+    // The undo journal is cleared, it describes edits of the replaced text.
+    void replace_buffer(handle& s, std::string_view text, size_t cursor)
+    {
+      if (refuse_wide(s, text))
+        return;
+      s.journal.clear();
+      s.journal_text.clear();
+      s.journal_pos = 0;
+      s.buffer.assign(text);
+      s.wide = false;
+      note_width(s, text);
+      recompute_line_offset(s, 0);
+      make_room(s);
+      redisplay(s);
+
+      s.offset = cursor;
+      std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+      s.requested_pos_x = s.pos_x;
+      move_to(s, s.pos_x, s.pos_y);
+      if (s.buffer.empty())
+        show_empty_message(s, s.get_empty_message());
+    }
+
+
+    // Replace the NREMOVE bytes at OFFSET with the concatenation of the two pieces of TEXT and place
+    // the cursor at CURSOR, for undo, redo, and yank.
+    void apply_edit(handle& s, size_t offset, size_t nremove, const std::array<std::string_view, 2>& text, size_t cursor)
+    {
+      auto row = row_at(s, offset);
+      s.buffer.erase(offset, offset + nremove);
+      s.buffer.insert(offset, text[0]);
+      s.buffer.insert(offset + text[0].size(), text[1]);
+      note_width(s, text[0]);
+      note_width(s, text[1]);
+      recompute_line_offset(s, row);
+      make_room(s);
+      redisplay(s);
+
+      s.offset = cursor;
+      std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+      s.requested_pos_x = s.pos_x;
+      move_to(s, s.pos_x, s.pos_y);
+      if (s.buffer.empty())
+        show_empty_message(s, s.get_empty_message());
+    }
+
+
+    bool cb_undo(handle& s)
+    {
+      if (s.journal_pos > 0 && s.select_idx == 0) {
+        const auto& rec = s.journal[--s.journal_pos];
+        std::string_view removed(s.journal_text.data() + rec.text, rec.nremoved);
+        apply_edit(s, rec.offset, rec.ninserted, {removed}, rec.cursor);
+      }
+      return false;
+    }
+
+
+    bool cb_redo(handle& s)
+    {
+      if (s.journal_pos < s.journal.size() && s.select_idx == 0) {
+        const auto& rec = s.journal[s.journal_pos++];
+        std::string_view inserted(s.journal_text.data() + rec.text + rec.nremoved, rec.ninserted);
+        apply_edit(s, rec.offset, rec.nremoved, {inserted}, rec.offset + rec.ninserted);
+      }
+      return false;
+    }
+
+
+    bool cb_kill_word(handle& s)
+    {
+      if (s.offset < s.buffer.size() && s.select_idx == 0) {
+        auto end = forward_word_end(s);
+        kill_text(s, s.offset, end, false);
+        record_edit(s, s.offset, end - s.offset, {}, s.offset);
+        apply_edit(s, s.offset, end - s.offset, {}, s.offset);
+      }
+      return false;
+    }
+
+
+    bool cb_backward_kill_word(handle& s)
+    {
+      if (s.offset > 0 && s.select_idx == 0) {
+        auto start = backward_word_start(s);
+        kill_text(s, start, s.offset, true);
+        record_edit(s, start, s.offset - start, {}, s.offset);
+        apply_edit(s, start, s.offset - start, {}, start);
+      }
+      return false;
+    }
+
+
+    // Replace the NREMOVE bytes at the start of the last yank with entry YANK_IDX of the kill ring.
+    void yank(handle& s, size_t nremove)
+    {
+      // The entry is inserted at once, straight from the two pieces of the ring.
+      auto text = (*s.kills)[s.yank_idx];
+      if (refuse_wide(s, text[0]) || refuse_wide(s, text[1]))
+        return;
+      auto len = text[0].size() + text[1].size();
+      record_edit(s, s.yank_start, nremove, text, s.offset);
+      apply_edit(s, s.yank_start, nremove, text, s.yank_start + len);
+      s.yank_len = len;
+      s.yank_serial = s.key_serial;
+    }
+
+
+    bool cb_yank(handle& s)
+    {
+      if (! s.kills->empty() && s.select_idx == 0) {
+        s.yank_idx = 0;
+        s.yank_start = s.offset;
+        yank(s, 0);
+      }
+      return false;
+    }
+
+
+    // Replace the text just yanked with the next older entry of the kill ring.
+    bool cb_yank_pop(handle& s)
+    {
+      if (s.yank_serial + 1 == s.key_serial && s.kills->size() > 1) {
+        s.yank_idx = (s.yank_idx + 1) % s.kills->size();
+        yank(s, s.yank_len);
+      }
+      return false;
+    }
+
+
+    // Value of handle::hist_idx when the edited line is shown.
+    constexpr size_t hist_edited = std::numeric_limits<size_t>::max();
+
+    // Check whether the history can be used.  If the edited line is shown it is saved and the
+    // history is brought up to date.
+    bool history_begin(handle& s)
+    {
+      if (s.hist == nullptr || ! s.select_options.empty())
+        return false;
+      if (s.hist_idx == hist_edited) {
+        s.hist->refresh();
+        s.hist_line = s.buffer.view();
+      }
+      return true;
+    }
+
+
+    // Entry IDX of the history.  Line breaks are stored as carriage returns, see history::add.
+    // They are restored if the input can contain them.
+    std::string_view history_entry(handle& s, size_t idx)
+    {
+      auto e = (*s.hist)[idx];
+      if (! e.contains('\r'))
+        return e;
+      s.scratch.assign(e);
+      std::ranges::replace(s.scratch, '\r', line_breaks_allowed(s) ? '\n' : ' ');
+      return s.scratch;
+    }
+
+
+    bool cb_history_previous(handle& s)
+    {
+      if (history_begin(s)) {
+        auto idx = s.hist_idx == hist_edited ? s.hist->size() : s.hist_idx;
+        if (idx > 0) {
+          s.hist_idx = idx - 1;
+          auto e = history_entry(s, s.hist_idx);
+          replace_buffer(s, e, e.size());
+        }
+      }
+      return false;
+    }
+
+
+    bool cb_history_next(handle& s)
+    {
+      if (history_begin(s) && s.hist_idx != hist_edited) {
+        if (++s.hist_idx == s.hist->size()) {
+          s.hist_idx = hist_edited;
+          replace_buffer(s, s.hist_line, s.hist_line.size());
+        } else {
+          auto e = history_entry(s, s.hist_idx);
+          replace_buffer(s, e, e.size());
+        }
+      }
+      return false;
+    }
+
+
+    // During an incremental search the search string is shown after the text if there is room
+    // in the last row.
+    void show_search_label(handle& s)
+    {
+      static constexpr std::string_view label_start = " (search: ";
+      auto last = s.line_offset.size() - 1;
+      auto used = (last == 0 ? s.prompt_len : 0) + ncols(s, last, s.buffer.size());
+      if (used + label_start.size() + count_chars(reinterpret_cast<const uint8_t*>(s.search_str.data()), s.search_str.size()) + 1 < s.term_cols) {
+        const std::string_view coloff = s.colsel.empty() ? std::string_view("\e[m") : std::string_view(s.colsel);
+        move_to(s, used, last);
+        sgr_color(s.outbuf, s.empty_message_fg, &s.text_default_bg);
+        out(s, label_start);
+        out(s, s.search_str);
+        out(s, ")");
+        out(s, coloff);
+        // The label is not part of the screen model.
+        s.shadow.clear();
+        move_to(s, s.pos_x, s.pos_y);
+      }
+    }
+
+
+    // Show the newest match of the search string in an entry with index lower than BEFORE.
+    void search_update(handle& s, size_t before)
+    {
+      if (auto r = s.hist->search(s.search_str, before); r) {
+        s.search_failed = 0;
+        s.search_idx = std::get<0>(*r);
+        replace_buffer(s, history_entry(s, s.search_idx), std::get<1>(*r));
+        show_search_label(s);
+      } else {
+        s.search_failed = s.search_str.size();
+        out(s, "\a");
+      }
+    }
+
+
+    bool cb_reverse_search(handle& s)
+    {
+      if (history_begin(s)) {
+        if (! s.searching) {
+          s.searching = true;
+          s.search_str.clear();
+          s.search_failed = 0;
+          s.search_idx = s.hist_idx == hist_edited ? s.hist->size() : s.hist_idx;
+          show_search_label(s);
+        } else if (! s.search_str.empty())
+          // Look for an older match.
+          search_update(s, s.search_idx);
+      }
+      return false;
+    }
+
+
+    // Handle KEY during an incremental search.  Returns false if the key ends the search and has
+    // to be handled normally.
+    bool search_key(handle& s, const ::TermKeyKey& key)
+    {
+      if (key.type == ::TERMKEY_TYPE_UNICODE && (key.modifiers & (::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_CTRL)) == 0) {
+        s.search_str.append(key.utf8);
+        if (s.search_failed != 0)
+          // A prefix of the string had no match, the longer string cannot match either.
+          out(s, "\a");
+        else
+          // The current match might still match.
+          search_update(s, s.search_idx + 1);
+        return true;
+      }
+      if (key.type == ::TERMKEY_TYPE_KEYSYM && key.code.sym == ::TERMKEY_SYM_BACKSPACE) {
+        if (! s.search_str.empty()) {
+          auto n = s.search_str.size();
+          do
+            --n;
+          while (n > 0 && (s.search_str[n] & 0xc0) == 0x80);
+          s.search_str.resize(n);
+          if (s.search_str.empty()) {
+            s.search_failed = 0;
+            redisplay(s);
+            move_to(s, s.pos_x, s.pos_y);
+            show_search_label(s);
+          } else
+            search_update(s, s.hist->size());
+        }
+        return true;
+      }
+      if ((key.type == ::TERMKEY_TYPE_UNICODE && key.modifiers == ::TERMKEY_KEYMOD_CTRL && key.code.codepoint == 'r'))
+        // Continue with the next match, see cb_reverse_search.
+        return false;
+
+      s.searching = false;
+      if ((key.type == ::TERMKEY_TYPE_UNICODE && key.modifiers == ::TERMKEY_KEYMOD_CTRL && key.code.codepoint == 'g') || (key.type == ::TERMKEY_TYPE_KEYSYM && key.code.sym == ::TERMKEY_SYM_ESCAPE)) {
+        // Cancel the search.
+        s.hist_idx = hist_edited;
+        replace_buffer(s, s.hist_line, s.hist_line.size());
+        return true;
+      }
+
+      // Every other key ends the search, keeping the match.
+      s.hist_idx = s.search_idx < s.hist->size() ? s.search_idx : hist_edited;
+      redisplay(s);
+      std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+      s.requested_pos_x = s.pos_x;
+      move_to(s, s.pos_x, s.pos_y);
+      return false;
+    }
+
+
+    // Replace the text between FROM and the cursor with TEXT.
+    void replace_before_cursor(handle& s, size_t from, std::string_view text)
+    {
+      if (refuse_wide(s, text))
+        return;
+      auto row = row_at(s, from);
+      record_edit(s, from, s.offset - from, {text}, s.offset);
+      s.buffer.erase(from, s.offset);
+      s.buffer.insert(from, text);
+      note_width(s, text);
+      s.offset = from + text.size();
+      recompute_line_offset(s, row);
+      make_room(s);
+      redisplay(s);
+
+      std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+      s.requested_pos_x = s.pos_x;
+      move_to(s, s.pos_x, s.pos_y);
+    }
+
+
+    // Show the completion candidates in the options menu below the buffer.  Like for the menu of
+    // prepare() the first row below the buffer is shared with the frame, if there is one.
+    void open_completion_menu(handle& s, std::vector<std::string>&& candidates)
+    {
+      s.select_options.clear();
+      s.select_options.emplace_back();
+      std::ranges::move(candidates, std::back_inserter(s.select_options));
+      s.select_idx = 1;
+      s.completing = true;
+      set_menu_height(s, s.cur_frame_lines + s.max_lines + s.scr_mgr->get_fixed_rows());
+
+      auto nnew = menu_rows(s) - s.cur_frame_lines;
+      auto bottom = s.initial_row + s.max_lines - 1 + s.cur_frame_lines + nnew + s.scr_mgr->get_fixed_rows();
+      if (bottom > s.term_rows) {
+        // The first line cannot be moved beyond the top of the screen.
+        auto nscroll = std::min<size_t>(bottom - s.term_rows, s.initial_row - 1 - s.cur_frame_lines);
+        if (nscroll > 0) {
+          csi(s.outbuf, nscroll, 'S');
+          s.initial_row -= nscroll;
+        }
+      }
+      move_to(s, 0, s.max_lines + s.cur_frame_lines);
+      adjust_lines(s, nnew);
+      show_options(s);
+    }
+
+
+    void close_completion_menu(handle& s)
+    {
+      move_to(s, 0, s.max_lines + s.cur_frame_lines);
+      adjust_lines(s, -int(menu_rows(s) - s.cur_frame_lines));
+      if (s.cur_frame_lines > 0) {
+        // The menu overwrote part of the frame row.
+        move_to(s, 0, s.max_lines);
+        const auto& fr = frame_rows(s);
+        out(s, fr.color);
+        out(s, fr.below);
+        out(s, "\e[0m");
+      }
+      out(s, s.colsel);
+
+      s.select_options.clear();
+      s.select_idx = 0;
+      s.completing = false;
+      move_to(s, s.pos_x, s.pos_y);
+      out(s, "\e[?25h");
+    }
+
+
+    bool cb_complete(handle& s)
+    {
+      if (s.completion == nullptr || ! s.select_options.empty() || s.complfd == -1)
+        return false;
+
+      uint64_t token;
+      {
+        std::lock_guard guard(s.compl_lock);
+        token = ++s.compl_token;
+        s.compl_ready = false;
+      }
+      s.compl_changes = s.buffer.changes();
+      s.compl_offset = s.offset;
+      s.completion(s, s.buffer.view(), s.offset, token);
+      return false;
+    }
+
+
+    // Handle the notification sent by handle::complete.
+    void apply_completion(handle& s)
+    {
+      uint64_t cnt;
+      (void) ::read(s.complfd, &cnt, sizeof(cnt));
+
+      std::vector<std::string> candidates;
+      size_t start;
+      {
+        std::lock_guard guard(s.compl_lock);
+        if (! s.compl_ready)
+          return;
+        s.compl_ready = false;
+        candidates = std::move(s.compl_candidates);
+        start = s.compl_start;
+        // Only one result per request.
+        ++s.compl_token;
+      }
+      if (s.term_state != state::open || s.buffer.changes() != s.compl_changes || s.offset != s.compl_offset || ! s.select_options.empty() || start > s.offset)
+        // Outdated.
+        return;
+
+      if (candidates.empty())
+        out(s, "\a");
+      else if (candidates.size() == 1)
+        replace_before_cursor(s, start, candidates.front());
+      else {
+        // Insert the common prefix of all candidates if this adds something.  Otherwise let the
+        // user choose.
+        std::string_view prefix = candidates.front();
+        for (const auto& c : candidates)
+          prefix = prefix.substr(0, std::ranges::mismatch(prefix, c).in1 - prefix.begin());
+        while (! prefix.empty() && prefix.size() < candidates.front().size() && (candidates.front()[prefix.size()] & 0xc0) == 0x80)
+          prefix.remove_suffix(1);
+        if (prefix.size() > s.offset - start)
+          replace_before_cursor(s, start, prefix);
+        else {
+          s.compl_start = start;
+          open_completion_menu(s, std::move(candidates));
+        }
+      }
+    }
+
+
+    // Handle KEY while the completion menu is shown.  Returns false if the key closes the menu and
+    // has to be handled normally.
+    bool completion_key(handle& s, const ::TermKeyKey& key)
+    {
+      auto sym = [&key](::TermKeySym ks, int mod = 0) { return key.type == ::TERMKEY_TYPE_KEYSYM && key.code.sym == ks && key.modifiers == mod; };
+      auto ctrl = [&key](char c) { return key.type == ::TERMKEY_TYPE_UNICODE && key.modifiers == ::TERMKEY_KEYMOD_CTRL && key.code.codepoint == c; };
+      auto n = s.select_options.size() - 1;
+
+      if (sym(::TERMKEY_SYM_TAB) || sym(::TERMKEY_SYM_DOWN) || ctrl('n'))
+        select_option(s, s.select_idx % n + 1);
+      else if (sym(::TERMKEY_SYM_TAB, ::TERMKEY_KEYMOD_SHIFT) || sym(::TERMKEY_SYM_UP) || ctrl('p'))
+        select_option(s, (s.select_idx + n - 2) % n + 1);
+      else if (sym(::TERMKEY_SYM_ENTER)) {
+        auto candidate = std::move(s.select_options[s.select_idx]);
+        close_completion_menu(s);
+        replace_before_cursor(s, s.compl_start, candidate);
+      } else if (sym(::TERMKEY_SYM_ESCAPE) || ctrl('g'))
+        close_completion_menu(s);
+      else {
+        close_completion_menu(s);
+        return false;
+      }
+      return true;
+    }
+
+
+    bool cb_newline(handle& s)
+    {
+      if (line_breaks_allowed(s)) {
+        record_edit(s, s.offset, 0, {"\n"}, s.offset);
+        s.buffer.insert(s.offset, "\n");
+        show_edit(s, s.pos_y, {s.offset + 1, 1, 1});
+        s.offset += 1;
+        place_cursor(s);
+      }
+      return false;
+    }
+
+
+    struct default_binding {
+      bool sym;
+      int mod;
+      long code;
+      keymap::function fct;
+    };
+
+    // clang-format off
+    constexpr default_binding default_bindings[] {
+      {false, ::TERMKEY_KEYMOD_CTRL, 'a', cb_beginning_of_line},
+      {true, 0, ::TERMKEY_SYM_HOME, cb_beginning_of_line},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'e', cb_end_of_line},
+      {true, 0, ::TERMKEY_SYM_END, cb_end_of_line},
+      {true, 0, ::TERMKEY_SYM_INSERT, cb_insert},
+      {true, 0, ::TERMKEY_SYM_ENTER, cb_enter},
+      {true, ::TERMKEY_KEYMOD_ALT, ::TERMKEY_SYM_ENTER, cb_newline},
+      {true, 0, ::TERMKEY_SYM_LEFT, cb_backward_char},
+      {true, 0, ::TERMKEY_SYM_RIGHT, cb_forward_char},
+      {true, 0, ::TERMKEY_SYM_UP, cb_previous_screen_line},
+      {true, 0, ::TERMKEY_SYM_DOWN, cb_next_screen_line},
+      {true, 0, ::TERMKEY_SYM_BACKSPACE, cb_backspace},
+      {true, 0, ::TERMKEY_SYM_DELETE, cb_delete},
+      {false, ::TERMKEY_KEYMOD_ALT, 'b', cb_backward_word},
+      {false, ::TERMKEY_KEYMOD_ALT, 'f', cb_forward_word},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'u', cb_unix_line_discard},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'k', cb_kill_line},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'p', cb_history_previous},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'n', cb_history_next},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'r', cb_reverse_search},
+      {true, 0, ::TERMKEY_SYM_TAB, cb_complete},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'w', cb_backward_kill_word},
+      {false, ::TERMKEY_KEYMOD_ALT, 'd', cb_kill_word},
+      {false, ::TERMKEY_KEYMOD_CTRL, 'y', cb_yank},
+      {false, ::TERMKEY_KEYMOD_ALT, 'y', cb_yank_pop},
+      {false, ::TERMKEY_KEYMOD_CTRL, '_', cb_undo},
+      {false, ::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_CTRL, '_', cb_redo},
+    };
+    // clang-format on
+
+    // The tables for the default bindings are computed at compile time.
+    constexpr keymap::tables default_key_tables = [] {
+      keymap::tables t{};
+      for (const auto& b : default_bindings)
+        if (b.sym)
+          t.syms[b.mod][b.code] = b.fct;
+        else
+          t.codes[b.mod][b.code] = b.fct;
+      return t;
+    }();
+
+    constexpr int keymod_mask = ::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_SHIFT | ::TERMKEY_KEYMOD_CTRL;
+
+
+    bool on_key(handle& s, ::TermKeyKey key)
+    {
+      if (key.type == ::TERMKEY_TYPE_UNICODE) {
+        if ((key.modifiers & (::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_CTRL)) == 0) {
+          assert(s.offset <= s.buffer.size());
+
+          // If selections are available and the current selection is not the input field,
+          // ignore the key stroke except if multi-select is available and SPACE is pressed.
+          // When filtering, only SPACE in multi-select mode is not added to the input.
+          if (s.select_idx > 0 && (! s.filter || (s.multi && key.code.codepoint == ' '))) {
+            if (s.multi) {
+              auto idx = option_at(s, s.select_idx);
+              if (s.selected.contains(idx))
+                s.selected.erase(idx);
+              else
+                s.selected.insert(idx);
+              show_option_row(s, s.select_idx);
+              finish_options(s);
+            }
+
+            return false;
+          }
+
+
+          uint8_t buf[8];
+          auto l = ::u8_uctomb(buf, key.code.codepoint, sizeof(buf));
+          auto to_print = l;
+          if (refuse_wide(s, std::string_view(reinterpret_cast<const char*>(buf), l)))
+            return false;
+
+          if (s.buffer.empty() && ! s.empty_message.empty())
+            out(s, "\e[K");
+          note_width(s, std::string_view(reinterpret_cast<const char*>(buf), l));
+
+          // Line breaks are not overwritten.
+          if (s.insert || s.offset == s.buffer.size() || s.buffer[s.offset] == '\n') {
+            record_edit(s, s.offset, 0, {std::string_view(reinterpret_cast<const char*>(buf), l)}, s.offset, true);
+            s.buffer.insert(s.offset, buf, l);
+
+            if (! simple_layout(s)) {
+              show_edit(s, s.pos_y, {s.offset + l, l, 1});
+              s.offset += l;
+              place_cursor(s);
+              return false;
+            } else if (s.multiline && s.highlighter != nullptr) {
+              // The styles of the following text might change as well.
+              recompute_line_offset(s, s.pos_y, {s.offset + l, l, 1});
+              make_room(s);
+              refresh_rows(s, s.pos_y);
+              to_print = 2;
+            } else if (s.multiline) {
+              // Recompute the affected line starts.
               [[maybe_unused]] auto old_nlines = s.line_offset.size();
-              recompute_line_offset(s, s.pos_y);
+              recompute_line_offset(s, s.pos_y, {s.offset + l, l, 1});
               to_print = s.buffer.size() - s.offset;
               if (s.pos_x == 0 && s.pos_y > 0 && s.offset + l == s.buffer.size()) {
                 // Terminal emulators remember when a line is continued after the last column, even if
@@ -798,11 +3139,10 @@ namespace nrl {
                 // continuation we go back and write the last character of the previous line and the new
                 // character together.
                 move_to(s, s.term_cols, s.pos_y - 1);
-                ucs4_t _;
-                auto p = ::u8_prev(&_, s.buffer.data() + s.offset, s.buffer.data());
-                ::write(s.fd, p, l + (s.buffer.data() + s.offset - p));
+                out(s, s.buffer.prev(s.offset), s.offset + l);
               } else
-                ::write(s.fd, s.buffer.data() + s.offset, to_print);
+                out(s, s.offset, s.buffer.size());
+              sync_shadow(s, s.pos_y);
               if (s.line_offset.size() > s.max_lines) {
                 assert(s.line_offset.size() == s.max_lines + 1);
                 s.max_lines = s.line_offset.size();
@@ -810,12 +3150,9 @@ namespace nrl {
                   // Need to scroll.
                   assert(s.line_offset.size() - old_nlines == 1);
                   s.initial_row -= 1;
-                  static const char SUrDL[] = "\e[S\r\e[1L";
-                  ::write(s.fd, SUrDL, strlen(SUrDL));
-                } else if (s.cur_frame_lines > 0) {
-                  static const char nDL[] = "\n\e[1L";
-                  ::write(s.fd, nDL, strlen(nDL));
-                }
+                  out(s, "\e[S\r\e[1L");
+                } else if (s.cur_frame_lines > 0)
+                  out(s, "\n\e[1L");
               }
             } else {
               if (s.initial_col + s.pos_x > std::max(1u, unsigned(0.9 * s.term_cols))) {
@@ -823,100 +3160,675 @@ namespace nrl {
                 auto [new_offset, nchars2] = offset_after_n_chars(s, nchars, s.line_offset[0]);
                 if (new_offset > s.offset)
                   new_offset = s.offset;
-                nchars2 = ::u8_mbsnlen(s.buffer.data(), new_offset);
+                nchars2 = s.buffer.nchars(0, new_offset);
                 assert(nchars2 > 0);
                 s.line_offset[0] = new_offset;
                 move_to(s, 1, s.initial_row);
-                static const char before[] = "«";
-                ::write(s.fd, before, strlen(before));
-                s.pos_x = 1 + ::u8_mbsnlen(s.buffer.data() + new_offset, s.offset - new_offset);
+                out(s, "«");
+                s.pos_x = 1 + s.buffer.nchars(new_offset, s.offset);
                 std::tie(new_offset, nchars2) = offset_after_n_chars(s, s.term_cols - 1, new_offset);
                 to_print = new_offset - s.line_offset[0];
-                ::write(s.fd, s.buffer.data() + s.line_offset[0], to_print);
+                out(s, s.line_offset[0], new_offset);
               } else {
                 auto nchars = std::min(s.term_cols - (s.initial_col + s.pos_x), unsigned(s.buffer.size()));
                 auto [new_offset, nchars2] = offset_after_n_chars(s, nchars, s.offset);
                 to_print = new_offset - s.offset;
-                ::write(s.fd, s.buffer.data() + s.offset, to_print);
+                out(s, s.offset, new_offset);
               }
+              sync_shadow(s, 0);
             }
           } else {
-            ucs4_t ignore;
-            auto l_old = ::u8_mbtoucr(&ignore, s.buffer.data() + s.offset, s.buffer.size() - s.offset);
-            assert(ignore != 0xfffd);
+            assert(s.buffer.get(s.offset) != 0xfffd);
+            int l_old = s.buffer.next(s.offset) - s.offset;
+            record_edit(s, s.offset, l_old, {std::string_view(reinterpret_cast<const char*>(buf), l)}, s.offset);
+            s.buffer.erase(s.offset, s.offset + l_old);
+            s.buffer.insert(s.offset, buf, l);
+            if (! simple_layout(s)) {
+              show_edit(s, s.pos_y, {s.offset + l, l - l_old, 0});
+              s.offset += l;
+              place_cursor(s);
+              return false;
+            }
             if (l_old != l) {
               int delta = l - l_old;
-              if (delta < 0)
-                s.buffer.insert(s.buffer.begin() + s.offset, 0, l - l_old);
-              else
-                s.buffer.erase(s.buffer.begin() + s.offset, s.buffer.begin() + s.offset + (l_old - l));
 
-              // Adjust the later line offsets.
-              std::for_each(s.line_offset.begin() + s.pos_y + 1, s.line_offset.end(), [](auto& n) { n += 1; });
-            }
-            std::copy_n(buf, l, s.buffer.begin() + s.offset);
-            ::write(s.fd, s.buffer.data() + s.offset, l);
-          }
+              // Adjust the later line offsets.
+              std::for_each(s.line_offset.begin() + s.pos_y + 1, s.line_offset.end(), [delta](auto& n) { n += delta; });
+            }
+            if (s.multiline && s.highlighter != nullptr) {
+              refresh_rows(s, s.pos_y);
+              to_print = 2;
+            } else {
+              out(s, s.offset, s.offset + l);
+              sync_shadow(s, s.pos_y, s.pos_y + 1);
+            }
+          }
+
+          s.offset += l;
+          s.requested_pos_x = s.pos_x += 1;
+          if (s.pos_x == s.term_cols) {
+            s.pos_x = 0;
+            s.pos_y += 1;
+            // Force moving the cursor.  Otherwise the cursor stays at the end of the line when the
+            // new character is written into the last column.
+            to_print = 2;
+          }
+
+          if (to_print > 1)
+            move_to(s, s.pos_x, s.pos_y);
+        } else if (auto cb = s.keys->lookup(false, key.modifiers, key.code.codepoint); cb != nullptr)
+          return cb(s);
+      } else if (key.type == ::TERMKEY_TYPE_KEYSYM) {
+        auto was_empty = s.buffer.empty();
+        if (auto cb = s.keys->lookup(true, key.modifiers, key.code.sym); cb != nullptr) {
+          auto res = cb(s);
+
+          if (! was_empty && s.buffer.empty()) [[unlikely]]
+            show_empty_message(s, s.get_empty_message());
+
+          return res;
+        }
+      }
+
+      return false;
+    }
+
+
+    // Second part of the preparation for a new input, after the position of the cursor is known.
+    void start_display(handle& s, unsigned row)
+    {
+      s.initial_row = row + s.cur_frame_lines;
+      s.initial_col = 1;
+
+      auto fixed_rows = s.scr_mgr->get_fixed_rows();
+      if (s.select_options.size() > 1)
+        // Long lists are shown in a window which fits on the screen.
+        set_menu_height(s, s.cur_frame_lines + 1 + fixed_rows);
+      auto nrows = std::max(1zu, menu_rows(s));
+      if (s.initial_row + nrows - 1 + s.cur_frame_lines + fixed_rows > s.term_rows) {
+        auto nscrolled = s.initial_row + nrows - 1 + s.cur_frame_lines + fixed_rows - s.term_rows;
+        // std::format_to(std::back_inserter(s.outbuf), "\e[{}S", nscrolled);
+        s.initial_row -= nscrolled;
+
+        // std::format_to(std::back_insert_iterator(s.outbuf), "\e[{}B\e[{}L", 1 + s.cur_frame_lines, s.select_options.size() - s.cur_frame_lines);
+        out(s, "\e[m");
+        csi(s.outbuf, 1 + s.cur_frame_lines, 'B');
+
+        adjust_lines(s, menu_rows(s) - s.cur_frame_lines);
+      }
+
+      move_to(s, 0, -s.cur_frame_lines);
+
+      s.redraw();
+    }
+
+
+    // Filter the options again if the buffer changed.
+    void update_filter(handle& s)
+    {
+      if (s.filter && ! s.completing && s.select_options.size() > 1 && s.buffer.changes() != s.filter_changes)
+        refilter(s);
+    }
+
+
+    // Handle one key.  Returns true if the input is complete.
+    bool dispatch_key(handle& s, const ::TermKeyKey& key)
+    {
+      count(s, &handle::statistics::keys);
+      PROBE(key, &s, key.type, key.code.number);
+      if (key.type == ::TERMKEY_TYPE_UNKNOWN_CSI) {
+        // Only the paste markers are recognized, see paste_marker.
+        if (key.code.number == paste_start)
+          s.pasting = true;
+        else if (key.code.number == paste_end && s.pasting) {
+          finish_paste(s);
+          update_filter(s);
+        }
+        return false;
+      }
+      if (s.pasting) {
+        add_to_paste(s, key);
+        return false;
+      }
+
+      if (key.type == ::TERMKEY_TYPE_UNICODE && key.modifiers == ::TERMKEY_KEYMOD_CTRL) {
+        if (key.code.codepoint == 'C' || key.code.codepoint == 'c' || (s.buffer.empty() && (key.code.codepoint == 'D' || key.code.codepoint == 'd')))
+          return true;
+      }
+
+      if (s.completing && completion_key(s, key))
+        return false;
+      if (s.searching && search_key(s, key))
+        return false;
+
+      ++s.key_serial;
+      auto done = on_key(s, key);
+      if (! done)
+        update_filter(s);
+      return done;
+    }
+
+
+    // Paint the rows of the frame above and below the input again.
+    void show_frame(handle& s)
+    {
+      const auto& fr = frame_rows(s);
+      out(s, "\e[m");
+      out(s, fr.color);
+      move_to(s, 0, -1);
+      out(s, fr.above);
+      move_to(s, 0, s.max_lines);
+      out(s, fr.below);
+      out(s, "\e[0m");
+      out(s, s.colsel);
+    }
+
+
+    // Apply a change of the window size.  Terminals usually do not rewrap what was written before
+    // the change, rows which are too long for a narrower window are cut off.  The screen model is
+    // adjusted the same way.  Then the lines are wrapped for the new width and only the rows whose
+    // content differs from the model are repainted.  The frame rows span the whole width, they are
+    // painted again if it changed.  Nothing has to be done if the size did not change or all rows
+    // are short enough to be unaffected.
+    void apply_resize(handle& s)
+    {
+      auto [cols, rows] = update_winsize(s.fd);
+      if (cols == s.term_cols && rows == s.term_rows)
+        return;
+      invalidate_terminal_info(s.fd);
+      auto old_cols = s.term_cols;
+      s.term_cols = cols;
+      s.term_rows = rows;
+
+      if (s.term_state != state::open || s.awaiting_pos)
+        return;
+      // The frame rows are cut off or too short for the new width.
+      auto repaint_frame = cols != old_cols && s.cur_frame_lines > 0;
+      if (s.buffer.empty() || ! s.multiline) {
+        if (! s.multiline)
+          // The text is shown in a single row which is repainted when the cursor moves.
+          s.shadow.clear();
+        if (repaint_frame) {
+          show_frame(s);
+          move_to(s, s.pos_x, s.pos_y);
+          flush_output(s);
+        }
+        return;
+      }
+
+      if (s.wide)
+        // The rows of the screen model cannot be cut at a column.
+        s.shadow.clear();
+      else if (cols < old_cols)
+        for (size_t r = 0; r < s.shadow.size(); ++r) {
+          auto avail = cols - (r == 0 ? std::min(cols, s.prompt_len) : 0);
+          auto& row = s.shadow[r];
+          auto [len, n] = advance_chars(reinterpret_cast<const uint8_t*>(row.data()), row.size(), avail);
+          row.resize(len);
+        }
+
+      recompute_line_offset(s, 0);
+      std::tie(s.pos_x, s.pos_y) = offset_to_pos(s, s.offset);
+      s.requested_pos_x = s.pos_x;
+      make_room(s);
+      if (s.highlighter != nullptr)
+        update_highlight(s);
+      for (size_t r = 0; r < s.line_offset.size(); ++r)
+        update_row(s, r);
+      if (s.max_lines > s.line_offset.size()) {
+        move_to(s, 0, s.line_offset.size());
+        out(s, "\e[m");
+        csi(s.outbuf, s.max_lines - s.line_offset.size(), 'M');
+        out(s, s.colsel);
+        s.max_lines = s.line_offset.size();
+      }
+      sync_shadow(s, 0);
+      if (repaint_frame)
+        show_frame(s);
+      if (s.select_options.size() > 1)
+        show_options(s);
+      move_to(s, s.pos_x, s.pos_y);
+      flush_output(s);
+    }
+
+
+    std::tuple<bool, bool> handle_one(handle& s, ::epoll_event& epev)
+    {
+      if (epev.data.fd == input_fd(s)) {
+        if (s.uring) {
+          // Completed reads are passed to termkey, further output is submitted.
+          if (uring_reap(s))
+            return {true, true};
+        } else {
+          if ((epev.events & EPOLLOUT) != 0)
+            flush_output(s);
+          if ((epev.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) == 0)
+            return {true, false};
+
+          ::termkey_advisereadable(s.tk);
+        }
+
+        ::TermKeyKey key;
+        ::TermKeyResult r;
+        while ((r = ::termkey_getkey(s.tk, &key)) == ::TERMKEY_RES_KEY) {
+          if (key.type == ::TERMKEY_TYPE_POSITION && s.awaiting_pos) {
+            int line;
+            int col;
+            ::termkey_interpret_position(s.tk, &key, &line, &col);
+            s.awaiting_pos = false;
+            start_display(s, line);
+
+            // Handle the keys which arrived in the meantime.
+            for (size_t i = 0; i < s.pending_keys.size(); ++i)
+              if (dispatch_key(s, s.pending_keys[i])) {
+                s.pending_keys.clear();
+                return {true, true};
+              }
+            s.pending_keys.clear();
+            continue;
+          }
+
+          if (key.type == ::TERMKEY_TYPE_UNKNOWN_CSI && (echo_marker(s, key) || ! paste_marker(s, key)))
+            // Ignore all other unknown sequences.
+            continue;
+
+          if (s.awaiting_pos)
+            s.pending_keys.push_back(key);
+          else if (dispatch_key(s, key))
+            return {true, true};
+        }
+
+        if (r == ::TERMKEY_RES_EOF)
+          return {true, true};
+      } else if (epev.data.fd == s.sigfd) {
+        // A burst of signals is handled at once.
+        ::signalfd_siginfo si;
+        while (::read(s.sigfd, &si, sizeof(si)) == sizeof(si))
+          ;
+        s.window_changed();
+      } else if (epev.data.fd == s.resizefd && s.resizefd != -1) {
+        uint64_t cnt;
+        (void) ::read(s.resizefd, &cnt, sizeof(cnt));
+        s.resize_pending = false;
+        apply_resize(s);
+      } else if (epev.data.fd == s.complfd && s.complfd != -1)
+        apply_completion(s);
+      else
+        return {false, false};
+
+      return {true, false};
+    }
+
+
+#ifdef NRL_IO_URING
+  } // anonymous namespace
+
+
+  // State of the io_uring backend.  The single read uses the registered input buffer.
+  struct handle::uring_state {
+    ::io_uring ring;
+    int evfd = -1;
+    std::array<char, 4096> inbuf;
+    // Output being written, WRITTEN bytes of it are done.
+    std::string writing;
+    size_t written = 0;
+    bool writing_pending = false;
+    // The read is in flight.  While the handle is suspended no new read is submitted.
+    bool reading = false;
+    bool suspended = false;
+    bool eof = false;
+  };
+
+
+  namespace {
+
+    // Tags of the requests.
+    constexpr uint64_t uring_read = 1;
+    constexpr uint64_t uring_write = 2;
+    constexpr uint64_t uring_cancel = 3;
+
+
+    void uring_submit_read(handle& s)
+    {
+      auto& u = *s.uring;
+      auto sqe = ::io_uring_get_sqe(&u.ring);
+      ::io_uring_prep_read_fixed(sqe, s.fd, u.inbuf.data(), u.inbuf.size(), -1, 0);
+      ::io_uring_sqe_set_data64(sqe, uring_read);
+      (void) ::io_uring_submit(&u.ring);
+      u.reading = true;
+    }
+
+
+    // Submit the accumulated output unless a write is still in progress.  Only one write is in
+    // flight at any time which keeps the output in order; what is produced in the meantime is
+    // coalesced and written afterwards.
+    void uring_submit_write(handle& s)
+    {
+      auto& u = *s.uring;
+      if (u.writing_pending)
+        return;
+      if (u.written == u.writing.size()) {
+        if (s.outbuf_written == s.outbuf.size())
+          return;
+        u.writing.swap(s.outbuf);
+        u.written = s.outbuf_written;
+        s.outbuf.clear();
+        s.outbuf_written = 0;
+      }
+      auto sqe = ::io_uring_get_sqe(&u.ring);
+      ::io_uring_prep_write(sqe, s.fd, u.writing.data() + u.written, u.writing.size() - u.written, -1);
+      ::io_uring_sqe_set_data64(sqe, uring_write);
+      (void) ::io_uring_submit(&u.ring);
+      u.writing_pending = true;
+    }
+
+
+    void uring_complete(handle& s, ::io_uring_cqe* cqe)
+    {
+      auto& u = *s.uring;
+      auto res = cqe->res;
+      auto tag = ::io_uring_cqe_get_data64(cqe);
+      if (tag == uring_read) {
+        u.reading = false;
+        if (res > 0) {
+          ::termkey_push_bytes(s.tk, u.inbuf.data(), res);
+          if (! u.suspended)
+            uring_submit_read(s);
+        } else if (res == -EAGAIN || res == -EINTR) {
+          if (! u.suspended)
+            uring_submit_read(s);
+        } else if (res != -ECANCELED)
+          u.eof = true;
+      } else if (tag == uring_write) {
+        u.writing_pending = false;
+        count(s, &handle::statistics::writes);
+        PROBE(write, s.fd, res);
+        if (res > 0) {
+          u.written += res;
+          count(s, &handle::statistics::bytes_written, res);
+        } else if (res != -EAGAIN && res != -EINTR)
+          // The terminal is gone.  There is nothing which can be done with the data.
+          u.written = u.writing.size();
+        uring_submit_write(s);
+      }
+      // The completion of a cancel request carries no information.
+    }
+
+
+    // Handle all completions.  Returns true if the end of the input was reached.
+    bool uring_reap(handle& s)
+    {
+      auto& u = *s.uring;
+      uint64_t cnt;
+      (void) ::read(u.evfd, &cnt, sizeof(cnt));
+
+      ::io_uring_cqe* cqe;
+      while (::io_uring_peek_cqe(&u.ring, &cqe) == 0) {
+        uring_complete(s, cqe);
+        ::io_uring_cqe_seen(&u.ring, cqe);
+      }
+      return u.eof;
+    }
+
+
+    void uring_flush(handle& s, bool wait)
+    {
+      auto& u = *s.uring;
+      uring_submit_write(s);
+      // Completions handled here also signal the eventfd.  The event is then handled later
+      // without finding anything.  Read data is kept by termkey.
+      ::io_uring_cqe* cqe;
+      while (wait && u.writing_pending && ::io_uring_wait_cqe(&u.ring, &cqe) == 0) {
+        uring_complete(s, cqe);
+        ::io_uring_cqe_seen(&u.ring, cqe);
+      }
+    }
+
+
+    // Cancel the pending read of a reusable handle when the input is finalized.  Otherwise the
+    // read would take the input meant for whoever uses the terminal until the handle is used
+    // again.  Data read before the cancellation took effect is kept by termkey.
+    void uring_suspend(handle& s)
+    {
+      auto& u = *s.uring;
+      u.suspended = true;
+      if (! u.reading)
+        return;
+      auto sqe = ::io_uring_get_sqe(&u.ring);
+      ::io_uring_prep_cancel64(sqe, uring_read, 0);
+      ::io_uring_sqe_set_data64(sqe, uring_cancel);
+      (void) ::io_uring_submit(&u.ring);
+      ::io_uring_cqe* cqe;
+      while (u.reading && ::io_uring_wait_cqe(&u.ring, &cqe) == 0) {
+        uring_complete(s, cqe);
+        ::io_uring_cqe_seen(&u.ring, cqe);
+      }
+    }
+
+
+    // Start reading again when a suspended handle is used again.
+    void uring_resume(handle& s)
+    {
+      auto& u = *s.uring;
+      u.suspended = false;
+      if (! u.reading && ! u.eof)
+        uring_submit_read(s);
+    }
+
+
+    void uring_setup(handle& s)
+    {
+      s.uring = std::make_unique<handle::uring_state>();
+      auto& u = *s.uring;
+      if (::io_uring_queue_init(8, &u.ring, 0) != 0) {
+        // Not supported by the kernel or not permitted.  Use the normal code path.
+        s.uring.reset();
+        return;
+      }
+      ::iovec iov{u.inbuf.data(), u.inbuf.size()};
+      u.evfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (u.evfd == -1 || ::io_uring_register_buffers(&u.ring, &iov, 1) != 0 || ::io_uring_register_eventfd(&u.ring, u.evfd) != 0) [[unlikely]] {
+        if (u.evfd != -1)
+          ::close(u.evfd);
+        ::io_uring_queue_exit(&u.ring);
+        s.uring.reset();
+        return;
+      }
+      uring_submit_read(s);
+    }
+
+
+    void uring_teardown(handle& s)
+    {
+      if (s.uring) {
+        // Outstanding requests are canceled.
+        ::io_uring_queue_exit(&s.uring->ring);
+        ::close(s.uring->evfd);
+        s.uring.reset();
+      }
+    }
+#else
+  } // anonymous namespace
+
+
+  struct handle::uring_state {};
+
+
+  namespace {
+
+    bool uring_reap(handle&) { return true; }
+    void uring_flush(handle&, bool) {}
+    void uring_suspend(handle&) {}
+    void uring_resume(handle&) {}
+    void uring_setup(handle&) {}
+    void uring_teardown(handle&) {}
+#endif
+
+
+    int input_fd(const handle& s)
+    {
+#ifdef NRL_IO_URING
+      if (s.uring)
+        return s.uring->evfd;
+#endif
+      return s.tkfd;
+    }
+
+
+    // The descriptor through which handle::complete signals a result.
+    void setup_completion_fd(handle& s)
+    {
+      if (s.completion == nullptr || s.complfd != -1)
+        return;
+
+      s.complfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (s.complfd == -1) [[unlikely]]
+        // This really should never happen.
+        ::error(EXIT_FAILURE, errno, "eventfd failed ?!");
+
+      epoll_event epev;
+      epev.events = EPOLLIN;
+      epev.data = event_data(s, s.complfd);
+      if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.complfd, &epev) != 0) [[unlikely]]
+        ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+    }
+
+
+    // The timer used to coalesce window size changes.
+    void setup_resize_fd(handle& s)
+    {
+      s.resizefd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (s.resizefd == -1) [[unlikely]]
+        // This really should never happen.
+        ::error(EXIT_FAILURE, errno, "timerfd_create failed ?!");
+
+      epoll_event epev;
+      epev.events = EPOLLIN;
+      epev.data = event_data(s, s.resizefd);
+      if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.resizefd, &epev) != 0) [[unlikely]]
+        ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+    }
+
+
+    // Size of the blocks read in headless mode.
+    constexpr size_t headless_block = 65536;
+
+
+    // Keep the input descriptor of the headless mode readable or not.
+    void set_ready(handle& s, bool ready)
+    {
+      if (ready == s.in_ready)
+        return;
+
+      uint64_t cnt = 1;
+      if (ready)
+        (void) ::write(s.tkfd, &cnt, sizeof(cnt));
+      else
+        (void) ::read(s.tkfd, &cnt, sizeof(cnt));
+      s.in_ready = ready;
+    }
+
+
+    void set_ready(handle& s)
+    {
+      set_ready(s, ! s.in_pollable || s.input_eof || s.in_start < s.in_end);
+    }
+
 
-          s.offset += l;
-          s.requested_pos_x = s.pos_x += 1;
-          if (s.pos_x == s.term_cols) {
-            s.pos_x = 0;
-            s.pos_y += 1;
-            // Force moving the cursor.  Otherwise the cursor stays at the end of the line when the
-            // new character is written into the last column.
-            to_print = 2;
-          }
+    void setup_headless(handle& s)
+    {
+      if (! s.fds_registered) {
+        s.tkfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (s.tkfd == -1) [[unlikely]]
+          // This really should never happen.
+          ::error(EXIT_FAILURE, errno, "eventfd failed ?!");
+        s.in_ready = false;
 
-          if (to_print > 1)
-            move_to(s, s.pos_x, s.pos_y);
-        } else if (auto cb = key_map.find({false, key.modifiers & (::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_SHIFT | ::TERMKEY_KEYMOD_CTRL), key.code.codepoint}); cb != key_map.end())
-          return cb->second(s);
-      } else if (key.type == ::TERMKEY_TYPE_KEYSYM) {
-        auto was_empty = s.buffer.empty();
-        if (auto cb = key_map.find({true, key.modifiers & (::TERMKEY_KEYMOD_ALT | ::TERMKEY_KEYMOD_SHIFT | ::TERMKEY_KEYMOD_CTRL), key.code.sym}); cb != key_map.end()) {
-          auto res = cb->second(s);
+        epoll_event epev;
+        epev.events = EPOLLIN;
+        epev.data = event_data(s, s.tkfd);
+        if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.tkfd, &epev) != 0) [[unlikely]]
+          ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
 
-          if (! was_empty && s.buffer.empty()) [[unlikely]]
-            show_empty_message(s, s.get_empty_message());
+        epev.data = event_data(s, s.fd);
+        if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.fd, &epev) == 0) {
+          s.in_pollable = true;
+          ::fcntl(s.fd, F_SETFL, ::fcntl(s.fd, F_GETFL) | O_NONBLOCK);
+        } else if (errno == EPERM)
+          // Regular files and the like are always readable.
+          s.in_pollable = false;
+        else [[unlikely]]
+          ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
 
-          return res;
-        }
+        s.fds_registered = true;
+      } else if (s.in_suspended) {
+        epoll_event epev;
+        epev.events = EPOLLIN;
+        epev.data = event_data(s, s.tkfd);
+        if (::epoll_ctl(s.epfd, EPOLL_CTL_MOD, s.tkfd, &epev) != 0) [[unlikely]]
+          ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+        epev.data = event_data(s, s.fd);
+        if (s.in_pollable && ::epoll_ctl(s.epfd, EPOLL_CTL_MOD, s.fd, &epev) != 0) [[unlikely]]
+          ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
       }
+      s.in_suspended = false;
+      set_ready(s);
 
-      return false;
+      s.term_state = state::open;
     }
 
 
-    std::tuple<bool, bool> handle_one(handle& s, ::epoll_event& epev)
+    // The next line of the headless mode, if it is available without waiting.
+    std::optional<std::string_view> headless_line(handle& s)
     {
-      if (epev.data.fd == s.tkfd) {
-        ::termkey_advisereadable(s.tk);
-
-        ::TermKeyKey key;
-        ::TermKeyResult r;
-        while ((r = ::termkey_getkey(s.tk, &key)) == ::TERMKEY_RES_KEY) {
-          if (key.type == ::TERMKEY_TYPE_UNICODE && key.modifiers == ::TERMKEY_KEYMOD_CTRL) {
-            if (key.code.codepoint == 'C' || key.code.codepoint == 'c' || (s.buffer.empty() && (key.code.codepoint == 'D' || key.code.codepoint == 'd')))
-              return {true, true};
+      while (true) {
+        if (s.in_scan < s.in_end)
+          if (auto nl = static_cast<const char*>(std::memchr(s.inbuf.data() + s.in_scan, '\n', s.in_end - s.in_scan)); nl != nullptr) {
+            std::string_view res(s.inbuf.data() + s.in_start, nl);
+            s.in_start = s.in_scan = nl + 1 - s.inbuf.data();
+            return res;
           }
+        s.in_scan = s.in_end;
 
-          if (on_key(s, key))
-            return {true, true};
+        if (s.input_eof) {
+          // The last line need not be terminated.
+          std::string_view res(s.inbuf.data() + s.in_start, s.in_end - s.in_start);
+          s.in_start = s.in_end;
+          return res;
         }
 
-        if (r == ::TERMKEY_RES_EOF)
-          return {true, true};
-      } else if (epev.data.fd == s.sigfd) {
-        ::signalfd_siginfo si;
-        ::read(s.sigfd, &si, sizeof(si));
-        std::tie(s.term_cols, s.term_rows) = update_winsize(s.fd);
+        if (s.in_start == s.in_end)
+          s.in_start = s.in_scan = s.in_end = 0;
+        else if (s.in_end == s.inbuf.size() && s.in_start > 0) {
+          // Move the incomplete line to the front.
+          std::memmove(s.inbuf.data(), s.inbuf.data() + s.in_start, s.in_end - s.in_start);
+          s.in_end -= s.in_start;
+          s.in_scan = s.in_end;
+          s.in_start = 0;
+        }
+        if (s.in_end == s.inbuf.size())
+          // No newline in the whole buffer.
+          s.inbuf.resize(std::max(headless_block, 2 * s.inbuf.size()));
+
+        auto n = ::read(s.fd, s.inbuf.data() + s.in_end, s.inbuf.size() - s.in_end);
+        if (n > 0)
+          s.in_end += n;
+        else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+          s.input_eof = true;
+        else if (errno == EAGAIN)
+          return std::nullopt;
+      }
+    }
 
-        // TODO: query cursor position and also if necesary adjust what is visible
-      } else
-        return {false, false};
 
-      return {true, false};
+    // Finish the input of the headless mode if a line is available.
+    std::optional<std::string_view> headless_input(handle& s)
+    {
+      auto res = headless_line(s);
+      set_ready(s);
+      if (res)
+        s.term_state = state::archived;
+      return res;
     }
 
 
@@ -924,47 +3836,98 @@ namespace nrl {
     {
       assert(s.term_state == state::closed || s.term_state == state::open);
 
-      if (s.term_state == state::closed) {
-        sigset_t mask;
-        sigemptyset(&mask);
-        sigaddset(&mask, SIGWINCH);
-        if (::sigprocmask(SIG_BLOCK, &mask, &s.old_mask) != 0) [[unlikely]]
-          // This really should never happen.
-          ::error(EXIT_FAILURE, errno, "sigprocmask failed ?!");
+      if (s.headless) {
+        if (s.term_state == state::closed)
+          setup_headless(s);
+        return;
+      }
+
+      if (s.term_state == state::closed && s.fds_registered) {
+        // Reused handle.  Just enable reading from the terminal again.
+        if (s.uring)
+          uring_resume(s);
+        epoll_event epev;
+        epev.events = EPOLLIN | EPOLLERR;
+        epev.data = event_data(s, input_fd(s));
+        if (::epoll_ctl(s.epfd, EPOLL_CTL_MOD, input_fd(s), &epev) != 0 && (errno != ENOENT || ::epoll_ctl(s.epfd, EPOLL_CTL_ADD, input_fd(s), &epev) != 0)) [[unlikely]]
+          ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+        s.want_output = false;
+        setup_completion_fd(s);
+
+        s.term_state = state::open;
+      } else if (s.term_state == state::closed) {
+        // A reactor handles SIGWINCH for all its handles.
+        if (s.rct == nullptr) {
+          sigset_t mask;
+          sigemptyset(&mask);
+          sigaddset(&mask, SIGWINCH);
+          if (::sigprocmask(SIG_BLOCK, &mask, &s.old_mask) != 0) [[unlikely]]
+            // This really should never happen.
+            ::error(EXIT_FAILURE, errno, "sigprocmask failed ?!");
+
+          s.sigfd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+          if (s.sigfd == -1) [[unlikely]]
+            // This really should never happen.
+            ::error(EXIT_FAILURE, errno, "sigfd failed ?!");
+        }
 
         std::tie(s.term_cols, s.term_rows) = update_winsize(s.fd);
 
-        s.sigfd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
-        if (s.sigfd == -1) [[unlikely]]
-          // This really should never happen.
-          ::error(EXIT_FAILURE, errno, "sigfd failed ?!");
+        if (s.use_uring && ::isatty(s.fd))
+          uring_setup(s);
 
         epoll_event epev;
         epev.events = EPOLLIN | EPOLLERR;
-        epev.data.fd = s.tkfd;
-        if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.tkfd, &epev) != 0) [[unlikely]] {
+        epev.data = event_data(s, input_fd(s));
+        if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, input_fd(s), &epev) != 0) [[unlikely]] {
           if (errno == EPERM) {
             assert(s.tk == nullptr);
             throw std::filesystem::filesystem_error("cannot use file descriptor", std::make_error_code(std::errc::inappropriate_io_control_operation));
           } else [[unlikely]]
             ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
-        } else
+        } else if (! s.uring)
+          // With io_uring blocking reads are wanted, the kernel waits for the data.
           ::fcntl(s.fd, F_SETFL, ::fcntl(s.fd, F_GETFL) | O_NONBLOCK);
 
-        epev.events = EPOLLIN | EPOLLERR;
-        epev.data.fd = s.sigfd;
-        if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.sigfd, &epev) != 0) [[unlikely]]
-          ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+        if (s.sigfd != -1) {
+          epev.events = EPOLLIN | EPOLLERR;
+          epev.data.fd = s.sigfd;
+          if (::epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.sigfd, &epev) != 0) [[unlikely]]
+            ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+        }
+        setup_completion_fd(s);
+        setup_resize_fd(s);
 
+        s.fds_registered = true;
         s.term_state = state::open;
       }
     }
 
 
+    // Stop reading from the terminal but keep the registration for reuse of the handle.
+    void suspend_fds(handle& s)
+    {
+      epoll_event epev;
+      epev.events = 0;
+      epev.data = event_data(s, input_fd(s));
+      // Ignore errors.  Maybe someone else cleared all descriptors?  With io_uring the pending
+      // read is canceled, data already read is used when the handle is used again.
+      (void) ::epoll_ctl(s.epfd, EPOLL_CTL_MOD, input_fd(s), &epev);
+      if (s.uring)
+        uring_suspend(s);
+      s.want_output = false;
+      if (s.headless) {
+        if (s.in_pollable)
+          (void) ::epoll_ctl(s.epfd, EPOLL_CTL_MOD, s.fd, &epev);
+        s.in_suspended = true;
+      }
+    }
+
+
     void cleanup_fds(handle& s)
     {
-      if (s.term_state == state::open) {
-        if (! sigismember(&s.old_mask, SIGWINCH)) {
+      if (s.fds_registered) {
+        if (s.sigfd != -1 && ! sigismember(&s.old_mask, SIGWINCH)) {
           sigset_t mask;
           sigemptyset(&mask);
           sigaddset(&mask, SIGWINCH);
@@ -973,133 +3936,613 @@ namespace nrl {
             ::error(EXIT_FAILURE, errno, "sigprocmask failed ?!");
         }
 
-        // Ignore errors.  Maybe someone else cleared all descriptors?
-        (void) ::epoll_ctl(s.epfd, EPOLL_CTL_DEL, s.tkfd, nullptr);
-        (void) ::epoll_ctl(s.epfd, EPOLL_CTL_DEL, s.sigfd, nullptr);
+        // Ignore errors.  Maybe someone else cleared all descriptors?
+        (void) ::epoll_ctl(s.epfd, EPOLL_CTL_DEL, input_fd(s), nullptr);
+        uring_teardown(s);
+        if (s.headless) {
+          if (s.in_pollable)
+            (void) ::epoll_ctl(s.epfd, EPOLL_CTL_DEL, s.fd, nullptr);
+          ::close(s.tkfd);
+          s.tkfd = -1;
+        }
+        if (s.sigfd != -1)
+          (void) ::epoll_ctl(s.epfd, EPOLL_CTL_DEL, s.sigfd, nullptr);
+        if (s.complfd != -1) {
+          (void) ::epoll_ctl(s.epfd, EPOLL_CTL_DEL, s.complfd, nullptr);
+          ::close(s.complfd);
+          s.complfd = -1;
+        }
+        if (s.resizefd != -1) {
+          (void) ::epoll_ctl(s.epfd, EPOLL_CTL_DEL, s.resizefd, nullptr);
+          ::close(s.resizefd);
+          s.resizefd = -1;
+          s.resize_pending = false;
+        }
+
+        if (s.sigfd != -1) {
+          ::close(s.sigfd);
+          ::sigprocmask(SIG_SETMASK, &s.old_mask, nullptr);
+        }
+        if (! s.extern_epfd)
+          ::close(s.epfd);
+        if (s.tk != nullptr)
+          ::termkey_destroy(s.tk);
+        s.tk = nullptr;
+        s.sigfd = -1;
+        if (! s.extern_epfd)
+          s.epfd = -1;
+
+        s.fds_registered = false;
+        if (s.term_state == state::open)
+          s.term_state = state::closed;
+      }
+    }
+
+
+    void finalize(handle& s)
+    {
+      if (s.completing)
+        close_completion_menu(s);
+      {
+        // Late completion results are dropped.
+        std::lock_guard guard(s.compl_lock);
+        ++s.compl_token;
+        s.compl_ready = false;
+      }
+      if (s.searching) {
+        // Remove the search label.
+        s.searching = false;
+        redisplay(s);
+      }
+      if (s.hist != nullptr && s.select_options.empty() && ! s.buffer.empty())
+        s.hist->add(s.buffer.view());
+
+      // The frame is drawn after the buffer content and after the menu lines are removed.
+      std::string_view frame_color;
+      std::string_view frame;
+      std::array<int, 2> rows_to_draw{};
+      size_t nrows_to_draw = 0;
+      if ((s.fl & handle::flags::frame) == handle::flags::frame_line && s.frame_highlight_fg != s.info->default_foreground) {
+        // Undo the frame highlighting.
+        frame = frame_rows(s).plain;
+        rows_to_draw[nrows_to_draw++] = -1;
+        rows_to_draw[nrows_to_draw++] = s.max_lines;
+      } else if ((s.fl & handle::flags::frame) == handle::flags::frame_background && s.select_options.size() > 1) {
+        const auto& fr = frame_rows(s);
+        frame_color = fr.color;
+        frame = fr.below;
+        rows_to_draw[nrows_to_draw++] = 1;
+      }
+
+      if (s.filter && (s.multi ? ! s.selected.empty() || s.select_idx > 0 : s.select_idx > 0))
+        // The buffer contains the filter query.
+        s.buffer.clear();
+      if (s.multi) {
+        if (s.buffer.empty() && s.selected.empty() && s.select_idx > 0)
+          s.buffer.append(s.select_options[option_at(s, s.select_idx)]);
+        else
+          // We concatenate the selections in the buffer and separate them "\N{NO-BREAK SPACE}&\N{NO-BREAK SPACE}"
+          for (size_t i = 0; i < s.select_options.size(); ++i)
+            if (s.selected.contains(i)) {
+              if (! s.buffer.empty())
+                s.buffer.append(s.select_sep);
+              s.buffer.append(s.select_options[i]);
+            }
+        note_width(s, s.buffer.view());
+        out(s, s.colsel);
+        redisplay(s);
+      } else if (s.select_idx > 0) {
+        s.buffer.assign(s.select_options[option_at(s, s.select_idx)]);
+        note_width(s, s.buffer.view());
+        s.offset = s.buffer.size();
+        out(s, s.colsel);
+        redisplay(s);
+      }
+      const bool clear_empty = ! s.multi && s.select_idx == 0 && s.buffer.empty() && ! s.empty_message.empty();
+
+      if (s.select_options.size() > 1) {
+        move_to(s, 0, s.max_lines + 1);
+        // Delete menu lines.
+        adjust_lines(s, -(menu_rows(s) - 1));
+      }
+
+      for (size_t i = 0; i < nrows_to_draw; ++i) {
+        move_to(s, 0, rows_to_draw[i]);
+        out(s, frame_color);
+        out(s, frame);
+      }
+
+      if (clear_empty) {
+        move_to(s, s.pos_x, s.pos_y);
+        out(s, "\e[K");
+      }
+
+      if (s.text_default_fg != terminal::info::color{})
+        out(s, "\e[m");
+
+      if (s.select_options.size() > 1)
+        // Turn cursor back on.
+        out(s, "\e[?25h");
+
+      unsigned last_row = ((s.fl & handle::flags::frame) == handle::flags::none ? s.line_offset.size() : s.max_lines) - 1 + s.cur_frame_lines;
+      move_to(s, s.term_cols - 1, last_row);
+      out(s, "\n");
+      // This is where the next input can start unless something else is written.
+      if (s.finalize_pos)
+        s.cursor_hint.emplace(1, std::min(s.initial_row + last_row + 1, s.term_rows));
+      s.awaiting_pos = false;
+      s.pending_keys.clear();
+
+      if (s.osc133)
+        out(s, osc133_C);
+
+      // Disable bracketed paste.
+      out(s, "\e[?2004l");
+      s.pasting = false;
+      s.paste.clear();
+
+      flush_output(s, true);
+
+      if (s.reusable)
+        suspend_fds(s);
+      else
+        cleanup_fds(s);
+
+      s.select_options.clear();
+
+      // Mark as archived instead of closed
+      s.term_state = state::archived;
+    }
+
+
+    void the_loop(handle& s)
+    {
+      s.prepare();
+
+      std::array<::epoll_event, 1> epev;
+      do {
+        flush_output(s);
+        auto n = TEMP_FAILURE_RETRY(::epoll_wait(s.epfd, epev.data(), epev.size(), -1));
+        assert(n > 0);
+      } while (! std::get<1>(handle_one(s, epev[0])));
+
+      finalize(s);
+    }
+
+
+    std::string_view headless_loop(handle& s)
+    {
+      s.prepare();
+
+      while (true) {
+        if (auto res = headless_input(s))
+          return *res;
+        ::pollfd pfd{.fd = s.fd, .events = POLLIN, .revents = 0};
+        (void) TEMP_FAILURE_RETRY(::poll(&pfd, 1, -1));
+      }
+    }
+
+
+    void init_state(handle& s)
+    {
+      TERMKEY_CHECK_VERSION;
+
+      s.osc133 = s.info->feature_set.contains(terminal::scroll_markers);
+
+      s.term_state = state::closed;
+    }
+
+  } // anonymous namespace
+
+
+  keymap::keymap() : t(default_key_tables)
+  {
+  }
+
+
+  void keymap::bind(bool sym, int mod, long code, function fct)
+  {
+    mod &= keymod_mask;
+    if (sym) {
+      if (code >= 0 && code < ::TERMKEY_N_SYMS)
+        t.syms[mod][code] = fct;
+    } else if (code >= 0 && code < long(ncodes))
+      t.codes[mod][code] = fct;
+    else if (fct == nullptr)
+      others.erase((uint64_t(mod) << 32) | uint32_t(code));
+    else
+      others[(uint64_t(mod) << 32) | uint32_t(code)] = fct;
+  }
+
+
+  keymap::function keymap::lookup(bool sym, int mod, long code) const
+  {
+    mod &= keymod_mask;
+    if (sym)
+      return code >= 0 && code < ::TERMKEY_N_SYMS ? t.syms[mod][code] : nullptr;
+    if (code >= 0 && code < long(ncodes)) [[likely]]
+      return t.codes[mod][code];
+    if (others.empty()) [[likely]]
+      return nullptr;
+    auto it = others.find((uint64_t(mod) << 32) | uint32_t(code));
+    return it == others.end() ? nullptr : it->second;
+  }
+
+
+  const keymap& keymap::defaults()
+  {
+    static const keymap def;
+    return def;
+  }
+
+
+  kill_ring::kill_ring(size_t capacity, size_t max_entries) : store(std::max<size_t>(capacity, 1)), entries(std::max<size_t>(max_entries, 1))
+  {
+  }
+
+
+  kill_ring& kill_ring::defaults()
+  {
+    static kill_ring def;
+    return def;
+  }
+
+
+  void kill_ring::store_text(std::string_view text)
+  {
+    auto pos = end % store.size();
+    auto n1 = std::min(text.size(), store.size() - pos);
+    std::memcpy(store.data() + pos, text.data(), n1);
+    std::memcpy(store.data(), text.data() + n1, text.size() - n1);
+    end += text.size();
+
+    // Drop the entries whose text was overwritten.
+    while (count > 0 && entries[head].start + store.size() < end) {
+      head = (head + 1) % entries.size();
+      --count;
+    }
+  }
+
+
+  void kill_ring::add(std::string_view text, bool append, bool before)
+  {
+    if (append && count > 0) {
+      if (text.empty())
+        return;
+      auto& last = entries[(head + count - 1) % entries.size()];
+      if (! before && last.start + last.len == end && last.len + text.size() <= store.size()) {
+        // The text of the most recent entry ends where new text is stored.
+        last.len += text.size();
+        store_text(text);
+        return;
+      }
+      // Combine the texts and replace the entry.
+      scratch.clear();
+      auto old = (*this)[0];
+      if (before)
+        scratch.append(text);
+      scratch.append(old[0]);
+      scratch.append(old[1]);
+      if (! before)
+        scratch.append(text);
+      --count;
+      text = scratch;
+    }
+
+    if (text.size() > store.size()) {
+      // Cut off at a character boundary.
+      auto n = store.size();
+      while (n > 0 && (text[n] & 0xc0) == 0x80)
+        --n;
+      text = text.substr(0, n);
+    }
+    if (count == entries.size()) {
+      head = (head + 1) % entries.size();
+      --count;
+    }
+    entries[(head + count) % entries.size()] = {end, text.size()};
+    ++count;
+    store_text(text);
+  }
+
+
+  std::array<std::string_view, 2> kill_ring::operator[](size_t idx) const
+  {
+    assert(idx < count);
+    const auto& e = entries[(head + count - 1 - idx) % entries.size()];
+    auto pos = e.start % store.size();
+    auto n1 = std::min(e.len, store.size() - pos);
+    return {std::string_view(store.data() + pos, n1), std::string_view(store.data(), e.len - n1)};
+  }
+
+
+  std::shared_ptr<terminal::info> get_terminal_info(int fd)
+  {
+    return cached_terminal(fd)->info;
+  }
+
+
+  void invalidate_terminal_info(int fd)
+  {
+    auto id = get_terminal_id(fd);
+    std::lock_guard guard(terminal_cache_lock);
+    terminal_cache.erase(id);
+  }
+
+
+  void gap_buffer::move_gap(size_t pos)
+  {
+    assert(pos <= size());
+    auto gap = gap_end - gap_start;
+    if (pos < gap_start)
+      std::memmove(store.data() + pos + gap, store.data() + pos, gap_start - pos);
+    else if (pos > gap_start)
+      std::memmove(store.data() + gap_start, store.data() + gap_end, pos - gap_start);
+    gap_start = pos;
+    gap_end = pos + gap;
+  }
+
+
+  void gap_buffer::grow(size_t n)
+  {
+    if (gap_end - gap_start < n) {
+      // Move the text after the gap to the end of the enlarged storage.
+      auto tail = store.size() - gap_end;
+      auto newsize = std::max(2 * store.size(), size() + n + 64);
+      store.resize(newsize);
+      ++nreallocs;
+      std::memmove(store.data() + newsize - tail, store.data() + gap_end, tail);
+      gap_end = newsize - tail;
+    }
+  }
+
+
+  void gap_buffer::insert(size_t pos, const uint8_t* p, size_t n)
+  {
+    move_gap(pos);
+    grow(n);
+    std::memcpy(store.data() + gap_start, p, n);
+    gap_start += n;
+    ++nchanges;
+  }
+
+
+  void gap_buffer::erase(size_t from, size_t to)
+  {
+    assert(from <= to && to <= size());
+    move_gap(from);
+    gap_end += to - from;
+    ++nchanges;
+  }
+
+
+  std::string_view gap_buffer::view()
+  {
+    if (gap_end != store.size())
+      move_gap(size());
+    return std::string_view(reinterpret_cast<const char*>(store.data()), gap_start);
+  }
+
+
+  std::array<std::string_view, 2> gap_buffer::segments(size_t from, size_t to) const
+  {
+    assert(from <= to && to <= size());
+    std::array<std::string_view, 2> res{};
+    auto base = reinterpret_cast<const char*>(store.data());
+    if (from < gap_start)
+      res[0] = std::string_view(base + from, std::min(to, gap_start) - from);
+    if (to > gap_start) {
+      auto start = std::max(from, gap_start);
+      res[1] = std::string_view(base + (gap_end - gap_start) + start, to - start);
+    }
+    return res;
+  }
+
 
-        ::close(s.sigfd);
-        if (! s.extern_epfd)
-          ::close(s.epfd);
-        ::sigprocmask(SIG_SETMASK, &s.old_mask, nullptr);
-        ::termkey_destroy(s.tk);
+  size_t gap_buffer::next(size_t pos) const
+  {
+    auto b = (*this)[pos];
+    // No incomplete or invalid character should have been added to the buffer.
+    assert(b < 0x80 || ((b & 0xc0) != 0x80 && b < 0xf8));
+    return pos + (b < 0x80 ? 1 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : 4);
+  }
 
-        s.term_state = state::closed;
-      }
-    }
 
+  size_t gap_buffer::prev(size_t pos) const
+  {
+    assert(pos > 0);
+    do
+      --pos;
+    while (pos > 0 && ((*this)[pos] & 0xc0) == 0x80);
+    return pos;
+  }
 
-    void finalize(handle& s)
-    {
-      std::array<iovec, 10> iov;
-      int niov = 0;
 
-      char movbuf1[40];
-      char movbuf2[40];
-      std::string frame;
-      if ((s.fl & handle::flags::frame) == handle::flags::frame_line && s.frame_highlight_fg != s.info->default_foreground) {
-        // Undo the frame highlighting.
-        for (size_t i = 0; i < s.term_cols; ++i)
-          frame.append("─");
-        size_t nmovbuf1 = move_to_buf(movbuf1, sizeof(movbuf1), s, 0, -1);
-        iov[niov++] = {movbuf1, nmovbuf1};
-        iov[niov++] = {frame.data(), frame.size()};
-        size_t nmovbuf2 = move_to_buf(movbuf2, sizeof(movbuf2), s, 0, s.max_lines);
-        iov[niov++] = {movbuf2, nmovbuf2};
-        iov[niov++] = {frame.data(), frame.size()};
-      } else if ((s.fl & handle::flags::frame) == handle::flags::frame_background && s.select_options.size() > 1) {
-        size_t nmovbuf1 = move_to_buf(movbuf1, sizeof(movbuf1), s, 0, 1);
-        iov[niov++] = {movbuf1, nmovbuf1};
-        if (s.frame_highlight_fg != s.info->default_foreground)
-          std::format_to(std::back_inserter(frame), "\e[m\e[38;2;{};{};{}m", s.frame_highlight_fg.r, s.frame_highlight_fg.g, s.frame_highlight_fg.b);
-        for (size_t i = 0; i < s.term_cols; ++i)
-          frame.append("\N{UPPER HALF BLOCK}");
-        iov[niov++] = {frame.data(), frame.size()};
-      }
+  uint32_t gap_buffer::get(size_t pos) const
+  {
+    std::array<uint8_t, 4> tmp;
+    auto n = std::min(tmp.size(), size() - pos);
+    for (size_t i = 0; i < n; ++i)
+      tmp[i] = (*this)[pos + i];
+    ucs4_t uc;
+    ::u8_mbtouc(&uc, tmp.data(), n);
+    return uc;
+  }
 
-      char movbuf3[40];
-      if (s.multi) {
-        if (s.buffer.empty() && s.selected.empty() && s.select_idx > 0)
-          s.buffer.append_range(s.select_options[s.select_idx]);
-        else
-          // We concatenate the selections in the buffer and separate them "\N{NO-BREAK SPACE}&\N{NO-BREAK SPACE}"
-          for (size_t i = 0; i < s.select_options.size(); ++i)
-            if (s.selected.contains(i)) {
-              if (! s.buffer.empty())
-                s.buffer.append_range(std::string_view{s.select_sep});
-              s.buffer.append_range(s.select_options[i]);
-            }
-        if (! s.colsel.empty())
-          ::write(s.fd, s.colsel.data(), s.colsel.size());
-        redisplay(s);
-      } else if (s.select_idx > 0) {
-        s.buffer.clear();
-        s.buffer.assign_range(s.select_options[s.select_idx]);
-        s.offset = s.buffer.size();
-        if (! s.colsel.empty())
-          ::write(s.fd, s.colsel.data(), s.colsel.size());
-        redisplay(s);
-      } else if (s.buffer.empty() && ! s.empty_message.empty()) {
-        size_t nmovbuf3 = move_to_buf(movbuf3, sizeof(movbuf3), s, s.pos_x, s.pos_y);
-        iov[niov++] = {movbuf3, nmovbuf3};
-        iov[niov++] = {const_cast<char*>("\e[K"), 3zu};
-      }
 
-      if (s.text_default_fg != terminal::info::color{})
-        iov[niov++] = {const_cast<char*>("\e[m"), 3};
+  size_t gap_buffer::nchars(size_t from, size_t to) const
+  {
+    size_t res = 0;
+    for (auto sv : segments(from, to))
+      res += count_chars(reinterpret_cast<const uint8_t*>(sv.data()), sv.size());
+    return res;
+  }
 
-      // std::string clearbuf;
-      if (s.select_options.size() > 1) {
-        move_to(s, 0, s.max_lines + 1);
-        // Delete menu lines and turn cursor back on.
-        // std::format_to(std::back_inserter(clearbuf), "\e[{}M\e[?25h", s.select_options.size() - 1);
-        // iov[niov++] = {clearbuf.data(), clearbuf.size()};
-        s.scr_mgr->adjust_lines(-(s.select_options.size() - 1));
-        iov[niov++] = {const_cast<char*>("\e[?25h"), 6};
-      }
 
-      char movbuf4[40];
-      size_t nmovbuf4 = move_to_buf(movbuf4, sizeof(movbuf4) - 1, s, s.term_cols - 1, ((s.fl & handle::flags::frame) == handle::flags::none ? s.line_offset.size() : s.max_lines) - 1 + s.cur_frame_lines);
-      movbuf4[nmovbuf4++] = '\n';
-      iov[niov++] = {movbuf4, nmovbuf4};
+  history::~history()
+  {
+    if (map != nullptr)
+      ::munmap(const_cast<char*>(map), mapped);
+    if (fd != -1)
+      ::close(fd);
+  }
 
-      if (s.osc133)
-        iov[niov++] = {const_cast<char*>(osc133_C), strlen(osc133_C)};
 
-      ::writev(s.fd, iov.data(), niov);
+  bool history::open(const std::string& path)
+  {
+    auto newfd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (newfd == -1)
+      return false;
 
-      cleanup_fds(s);
+    if (map != nullptr)
+      ::munmap(const_cast<char*>(map), mapped);
+    if (fd != -1)
+      ::close(fd);
+    fd = newfd;
+    map = nullptr;
+    mapped = 0;
+    mem.clear();
+    starts.clear();
+    indexed = 0;
+
+    refresh();
+    return true;
+  }
 
-      s.select_options.clear();
 
-      // Mark as archived instead of closed
-      s.term_state = state::archived;
+  void history::add(std::string_view line)
+  {
+    // A line break would end the entry.
+    std::string stored;
+    if (line.contains('\n')) {
+      stored = line;
+      std::ranges::replace(stored, '\n', '\r');
+      line = stored;
     }
 
+    // Compare with the newest entry, possibly added by another process.
+    refresh();
+    if (! empty() && (*this)[size() - 1] == line)
+      return;
 
-    void the_loop(handle& s)
-    {
-      s.prepare();
+    if (fd == -1) {
+      mem.append(line);
+      mem.push_back('\n');
+    } else {
+      // With O_APPEND a single write call adds the entry atomically, even if other processes
+      // use the same file.
+      std::array<::iovec, 2> iov{{{const_cast<char*>(line.data()), line.size()}, {const_cast<char*>("\n"), 1}}};
+      if (::writev(fd, iov.data(), iov.size()) != ssize_t(line.size() + 1))
+        return;
+    }
+    refresh();
+  }
 
-      std::array<::epoll_event, 1> epev;
-      do {
-        auto n = TEMP_FAILURE_RETRY(::epoll_wait(s.epfd, epev.data(), epev.size(), -1));
-        assert(n > 0);
-      } while (! std::get<1>(handle_one(s, epev[0])));
 
-      finalize(s);
-    }
+  void history::refresh()
+  {
+    if (fd != -1) {
+      struct ::stat st;
+      if (::fstat(fd, &st) != 0 || size_t(st.st_size) == mapped)
+        return;
 
+      auto drop = [this] {
+        if (map != nullptr)
+          ::munmap(const_cast<char*>(map), mapped);
+        map = nullptr;
+        mapped = 0;
+        starts.clear();
+        indexed = 0;
+      };
+      // If the file got shorter than the indexed entries it was truncated or rewritten by another
+      // process.  The index is rebuilt from the start.  An empty file cannot be mapped.
+      if (size_t(st.st_size) < indexed || st.st_size == 0) {
+        drop();
+        if (st.st_size == 0)
+          return;
+      }
 
-    void init_state(handle& s)
-    {
-      TERMKEY_CHECK_VERSION;
+      void* p;
+      if (map == nullptr)
+        p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      else
+        p = ::mremap(const_cast<char*>(map), mapped, st.st_size, MREMAP_MAYMOVE);
+      if (p == MAP_FAILED) [[unlikely]] {
+        // A failed mremap leaves the old mapping in place.
+        drop();
+        return;
+      }
+      map = static_cast<const char*>(p);
+      mapped = st.st_size;
+      // A file rewritten with a size of at least that of the old one is noticed if the indexed part
+      // no longer ends with a newline.
+      if (indexed > 0 && map[indexed - 1] != '\n') {
+        starts.clear();
+        indexed = 0;
+      }
+    }
+    index_new();
+  }
 
-      s.osc133 = s.info->feature_set.contains(terminal::scroll_markers);
 
-      s.term_state = state::closed;
+  void history::index_new()
+  {
+    auto d = data();
+    // Only complete entries are indexed.
+    while (indexed < d.size()) {
+      auto nl = static_cast<const char*>(std::memchr(d.data() + indexed, '\n', d.size() - indexed));
+      if (nl == nullptr)
+        break;
+      starts.push_back(indexed);
+      indexed = nl - d.data() + 1;
     }
+  }
 
-  } // anonymous namespace
+
+  std::string_view history::operator[](size_t idx) const
+  {
+    assert(idx < size());
+    auto end = idx + 1 < size() ? starts[idx + 1] : indexed;
+    return data().substr(starts[idx], end - 1 - starts[idx]);
+  }
+
+
+  std::optional<std::tuple<size_t, size_t>> history::search(std::string_view needle, size_t before) const
+  {
+    before = std::min(before, size());
+    if (before == 0)
+      return std::nullopt;
+    if (needle.empty())
+      return std::make_tuple(before - 1, 0zu);
+
+    // Search backward in blocks, the most recent entries are the most likely matches.  Within a
+    // block memmem finds the last match.  Entries are separated by newlines which cannot be part
+    // of NEEDLE, so blocks need only overlap by the length of NEEDLE minus one to not miss a match
+    // and no match straddles two entries.
+    auto d = data().substr(0, starts[before - 1] + (*this)[before - 1].size());
+    const size_t blocksize = std::max(size_t(65536), 2 * needle.size());
+    size_t hi = d.size();
+    while (hi >= needle.size()) {
+      auto lo = hi > blocksize ? hi - blocksize : 0;
+      const char* last = nullptr;
+      for (auto p = d.data() + lo; p + needle.size() <= d.data() + hi;) {
+        auto m = static_cast<const char*>(::memmem(p, d.data() + hi - p, needle.data(), needle.size()));
+        if (m == nullptr)
+          break;
+        last = m;
+        p = m + 1;
+      }
+      if (last != nullptr) {
+        size_t pos = last - d.data();
+        size_t idx = std::upper_bound(starts.begin(), starts.begin() + before, pos) - starts.begin() - 1;
+        return std::make_tuple(idx, pos - starts[idx]);
+      }
+      if (lo == 0)
+        break;
+      hi = lo + needle.size() - 1;
+    }
+    return std::nullopt;
+  }
 
 
   unsigned handle::default_screen_manager::get_fixed_rows() const
@@ -1110,20 +4553,17 @@ namespace nrl {
 
   void handle::default_screen_manager::adjust_lines(int delta)
   {
-    if (delta > 0) {
+    if (delta > 0)
       // Insert lines: CSI{n}L
-      std::string seq = std::format("\e[{}L", delta);
-      ::write(fd, seq.data(), seq.size());
-    } else if (delta < 0) {
+      csi(h.outbuf, delta, 'L');
+    else if (delta < 0)
       // Delete lines: CSI{n}M
-      std::string seq = std::format("\e[{}M", -delta);
-      ::write(fd, seq.data(), seq.size());
-    }
+      csi(h.outbuf, -delta, 'M');
   }
 
 
   handle::handle(int fd_, flags fl_, std::shared_ptr<terminal::info> info_)
-      : fd(fd_), fl(fl_), info(info_ ? std::move(info_) : terminal::info::alloc(fd)), frame_highlight_fg(info->default_foreground), tk(::termkey_new(fd, 0)), tkfd(::termkey_get_fd(tk)), epfd(::epoll_create1(EPOLL_CLOEXEC)), extern_epfd(false), default_scr_mgr(fd)
+      : fd(fd_), fl(fl_), headless(! ::isatty(fd_)), term_entry(info_ || headless ? nullptr : cached_terminal(fd_)), info(info_ ? std::move(info_) : term_entry ? term_entry->info : std::make_shared<terminal::info>()), frame_highlight_fg(info->default_foreground), tk(headless ? nullptr : ::termkey_new(fd, 0)), tkfd(headless ? -1 : ::termkey_get_fd(tk)), epfd(::epoll_create1(EPOLL_CLOEXEC)), extern_epfd(false), default_scr_mgr(*this)
   {
     if (epfd == -1) [[unlikely]]
       // This really should never happen.
@@ -1134,7 +4574,7 @@ namespace nrl {
 
 
   handle::handle(int epfd_, int fd_, flags fl_, std::shared_ptr<terminal::info> info_)
-      : fd(fd_), fl(fl_), info(info_ ? std::move(info_) : terminal::info::alloc(fd)), frame_highlight_fg(info->default_foreground), tk(::termkey_new(fd, 0)), tkfd(::termkey_get_fd(tk)), epfd(epfd_), extern_epfd(true), default_scr_mgr(fd)
+      : fd(fd_), fl(fl_), headless(! ::isatty(fd_)), term_entry(info_ || headless ? nullptr : cached_terminal(fd_)), info(info_ ? std::move(info_) : term_entry ? term_entry->info : std::make_shared<terminal::info>()), frame_highlight_fg(info->default_foreground), tk(headless ? nullptr : ::termkey_new(fd, 0)), tkfd(headless ? -1 : ::termkey_get_fd(tk)), epfd(epfd_), extern_epfd(true), default_scr_mgr(*this)
   {
     init_state(*this);
   }
@@ -1142,7 +4582,10 @@ namespace nrl {
 
   handle::~handle()
   {
+    flush_output(*this, true);
     cleanup_fds(*this);
+    if (rct != nullptr)
+      rct->remove(*this);
   }
 
 
@@ -1184,9 +4627,12 @@ namespace nrl {
 
   std::string_view handle::read()
   {
+    if (headless)
+      return headless_loop(*this);
+
     the_loop(*this);
 
-    return std::string_view(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    return buffer.view();
   }
 
 
@@ -1196,21 +4642,21 @@ namespace nrl {
 
     if (term_state == state::closed) {
       setup_epoll(*this);
+      if (headless) {
+        buffer.clear();
+        return;
+      }
+
+      // Enable bracketed paste.
+      out(*this, "\e[?2004h");
 
       buffer.clear();
 
-      if ((fl & handle::flags::frame) == handle::flags::frame_background) {
-        // We use as foreground a slightly adjusted version of the default background colors.
-        auto [fg, bg] = adjust_rgb(info->default_foreground, info->default_background, 32);
-        frame_highlight_fg = bg;
-        text_default_fg = fg;
-        text_default_bg = bg;
+      if (! colors_ready) {
+        apply_colors(*this);
+        colors_ready = true;
       }
 
-      colsel.clear();
-      if (text_default_fg != terminal::info::color{})
-        colsel = std::format("\e[38;2;{};{};{};48;2;{};{};{}m", text_default_fg.r, text_default_fg.g, text_default_fg.b, text_default_bg.r, text_default_bg.g, text_default_bg.b);
-
       if (std::holds_alternative<std::string>(prompt))
         prompt_str = std::get<std::string>(prompt);
       else if (std::holds_alternative<handle::string_callback>(prompt))
@@ -1222,49 +4668,85 @@ namespace nrl {
       pos_x = prompt_len;
       pos_y = 0u;
       line_offset = {0u};
+      row_cols = {0u};
+      logical = {0u};
+      wide = false;
+      hist_idx = hist_edited;
+      searching = false;
+      journal.clear();
+      journal_text.clear();
+      journal_pos = 0;
 
       select_idx = select_options.size() > 1 && select_options.front().empty() ? 1zu : 0zu;
+      filtered = false;
+      filter_query.clear();
+      if (filter && select_options.size() > 1)
+        build_filter_index(*this);
+      filter_changes = buffer.changes();
 
       // For interactive use.
       assert(buffer.empty());
 
       cur_frame_lines = (fl & handle::flags::frame) != handle::flags::none ? 1 : 0;
 
-      // Get current position.
-      std::tie(initial_col, initial_row) = get_current_pos(tkfd);
-      initial_row += cur_frame_lines;
-      initial_col = 1;
-
-      auto& msg = get_empty_message();
-      if (! msg.empty()) {
-        // Determine the foreground color to use.  It should be darker than the usual.
-        terminal::info::color fg;
-        terminal::info::color bg;
-        if ((fl & handle::flags::frame) != handle::flags::frame_background)
-          std::tie(fg, bg) = adjust_rgb(info->default_foreground, info->default_background, 48);
-        else
-          std::tie(fg, bg) = adjust_rgb(text_default_fg, text_default_bg, 48);
-        empty_message_fg = bg;
+      // Get current position.  Ask the terminal only if it is not known otherwise.
+      auto pos = cursor_hint;
+      cursor_hint.reset();
+      if (! pos)
+        pos = scr_mgr->get_cursor_pos();
+      if (pos)
+        start_display(*this, std::get<1>(*pos));
+      else if (async_pos || uring) {
+        // DECXCPR, the answer is recognized by termkey.  With io_uring a read is always pending
+        // and the terminal cannot be queried synchronously.
+        out(*this, "\e[?6n");
+        flush_output(*this);
+        awaiting_pos = true;
+        // A valid position until the real one is known.
+        initial_row = 1 + cur_frame_lines;
+        initial_col = 1;
+      } else {
+        // Everything written so far must be seen by the terminal.
+        flush_output(*this, true);
+        start_display(*this, std::get<1>(get_current_pos(tkfd)));
       }
+    }
+  }
 
-      auto fixed_rows = scr_mgr->get_fixed_rows();
-      if (initial_row + std::max(1zu, select_options.size()) - 1 + cur_frame_lines + fixed_rows > term_rows) {
-        std::string outs = "\e[m";
-        auto nscrolled = initial_row + std::max(1zu, select_options.size()) - 1 + cur_frame_lines + fixed_rows - term_rows;
-        // std::format_to(std::back_inserter(outs), "\e[{}S", nscrolled);
-        initial_row -= nscrolled;
-
-        // std::format_to(std::back_insert_iterator(outs), "\e[{}B\e[{}L", 1 + cur_frame_lines, select_options.size() - cur_frame_lines);
-        std::format_to(std::back_insert_iterator(outs), "\e[{}B", 1 + cur_frame_lines);
-        ::write(fd, outs.data(), outs.size());
 
-        scr_mgr->adjust_lines(select_options.size() - cur_frame_lines);
+  void handle::reset()
+  {
+    if (term_state != state::archived)
+      return;
+
+    if (! fds_registered) {
+      // The handle was not reusable.  Everything has to be allocated again.
+      if (! headless) {
+        tk = ::termkey_new(fd, 0);
+        tkfd = ::termkey_get_fd(tk);
+      }
+      if (! extern_epfd) {
+        epfd = ::epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1) [[unlikely]]
+          // This really should never happen.
+          ::error(EXIT_FAILURE, errno, "epoll_create failed ?!");
       }
-
-      move_to(*this, 0, -cur_frame_lines);
-
-      redraw();
     }
+
+    // The storage of the buffer is kept.
+    buffer.clear();
+    line_offset = {0u};
+    row_cols = {0u};
+    logical = {0u};
+    wide = false;
+    max_lines = 1;
+    shadow.clear();
+    selected.clear();
+    select_idx = 0;
+    filtered = false;
+    matches.clear();
+
+    term_state = state::closed;
   }
 
 
@@ -1293,60 +4775,354 @@ namespace nrl {
   std::expected<std::string_view, bool> handle::process(::epoll_event& epev)
   {
     // If widget is archived, don't process events
-    if (term_state == state::archived) [[unlikely]]
-      return std::unexpected(false);
+    if (term_state == state::archived) [[unlikely]] {
+      if (! fds_registered)
+        return std::unexpected(false);
+
+      if (headless) {
+        // Nothing is read until the next input is prepared.
+        if (epev.data.fd != fd && epev.data.fd != input_fd(*this))
+          return std::unexpected(false);
+        suspend_fds(*this);
+        return std::unexpected(true);
+      }
+
+      // A reusable handle still receives signals and terminal errors.  Consume them.
+      if (epev.data.fd == sigfd) {
+        ::signalfd_siginfo si;
+        while (::read(sigfd, &si, sizeof(si)) == sizeof(si))
+          ;
+        window_changed();
+      } else if (epev.data.fd == input_fd(*this))
+        (void) ::epoll_ctl(epfd, EPOLL_CTL_DEL, input_fd(*this), nullptr);
+      else if ((epev.data.fd == complfd && complfd != -1) || (epev.data.fd == resizefd && resizefd != -1)) {
+        uint64_t cnt;
+        (void) ::read(epev.data.fd, &cnt, sizeof(cnt));
+        if (epev.data.fd == resizefd) {
+          resize_pending = false;
+          apply_resize(*this);
+        }
+      } else
+        return std::unexpected(false);
+      return std::unexpected(true);
+    }
+
+    std::expected<std::string_view, bool> res;
+    if constexpr (NRL_STATS || NRL_PROBES) {
+      auto start = std::chrono::steady_clock::now();
+      res = process_(epev);
+      uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+      count(*this, &statistics::events);
+      count(*this, &statistics::process_ns, ns);
+      if constexpr (NRL_STATS)
+        counters.process_max_ns = std::max(counters.process_max_ns, ns);
+      PROBE(process, this, ns, res.has_value());
+    } else
+      res = process_(epev);
+    return res;
+  }
+
+
+  std::expected<std::string_view, bool> handle::process_(::epoll_event& epev)
+  {
+    if (headless) {
+      if (epev.data.fd != fd && epev.data.fd != input_fd(*this))
+        return std::unexpected(false);
+      if (auto res = headless_input(*this))
+        return *res;
+      return std::unexpected(true);
+    }
 
     auto [handled, done] = handle_one(*this, epev);
-    if (! done)
+    if (! done) {
+      flush_output(*this);
       return std::unexpected(handled);
-
-    cleanup_fds(*this);
+    }
 
     finalize(*this);
 
-    return std::string_view(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    return buffer.view();
+  }
+
+
+  void handle::window_changed()
+  {
+    if (headless)
+      return;
+
+    if (resizefd == -1) {
+      apply_resize(*this);
+      return;
+    }
+
+    if (! resize_pending) {
+      ::itimerspec its{};
+      its.it_value.tv_sec = resize_interval / 1000;
+      its.it_value.tv_nsec = (resize_interval % 1000) * 1'000'000l + (resize_interval == 0 ? 1 : 0);
+      if (::timerfd_settime(resizefd, 0, &its, nullptr) != 0) [[unlikely]]
+        // This really should never happen.
+        ::error(EXIT_FAILURE, errno, "timerfd_settime failed ?!");
+      resize_pending = true;
+    }
+  }
+
+
+  reactor::reactor()
+  {
+    epfd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) [[unlikely]]
+      // This really should never happen.
+      ::error(EXIT_FAILURE, errno, "epoll_create failed ?!");
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if (::sigprocmask(SIG_BLOCK, &mask, &old_mask) != 0) [[unlikely]]
+      // This really should never happen.
+      ::error(EXIT_FAILURE, errno, "sigprocmask failed ?!");
+    sigfd = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1) [[unlikely]]
+      // This really should never happen.
+      ::error(EXIT_FAILURE, errno, "sigfd failed ?!");
+
+    ::epoll_event epev;
+    epev.events = EPOLLIN;
+    epev.data.ptr = &sig_source;
+    if (::epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &epev) != 0) [[unlikely]]
+      ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+  }
+
+
+  reactor::~reactor()
+  {
+    ::close(sigfd);
+    ::close(epfd);
+    ::sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+  }
+
+
+  void reactor::add(handle& h)
+  {
+    assert(h.epfd == epfd && ! h.fds_registered);
+    h.rct = this;
+    h.tk_source.h = &h;
+    h.compl_source.h = &h;
+    h.resize_source.h = &h;
+    handles.push_back(&h);
+  }
+
+
+  void reactor::remove(handle& h)
+  {
+    std::erase(handles, &h);
+    // Events of the current round for the handle are not delivered anymore.
+    for (auto i = next_event; i < nevents; ++i)
+      if (events[i].data.ptr == &h.tk_source || events[i].data.ptr == &h.compl_source || events[i].data.ptr == &h.resize_source)
+        events[i].data.ptr = nullptr;
+    h.rct = nullptr;
+  }
+
+
+  int reactor::poll(int timeout, done_callback done)
+  {
+    auto n = ::epoll_wait(epfd, events.data(), events.size(), timeout);
+    if (n <= 0)
+      return n;
+
+    nevents = n;
+    for (next_event = 0; next_event < nevents;) {
+      auto& ev = events[next_event++];
+      auto src = static_cast<source*>(ev.data.ptr);
+      if (src == nullptr)
+        // Belongs to a removed handle.
+        continue;
+
+      if (src == &sig_source) {
+        // One signal for all terminals.  It is not known which terminal changed.
+        ::signalfd_siginfo si;
+        while (::read(sigfd, &si, sizeof(si)) == sizeof(si))
+          ;
+        for (auto h : handles)
+          h->window_changed();
+      } else if (src->h == nullptr)
+        src->cb(*src, ev.events);
+      else {
+        ::epoll_event hev;
+        hev.events = ev.events;
+        hev.data.fd = src->fd;
+        auto h = src->h;
+        if (auto res = h->process(hev); res && done != nullptr)
+          done(*h, *res);
+      }
+    }
+    nevents = 0;
+    next_event = 0;
+    return n;
+  }
+
+
+  namespace {
+
+    // The object whose thread is running, for the callback of reactor::poll.
+    thread_local io_thread* current_io_thread = nullptr;
+
+  } // anonymous namespace
+
+
+  io_thread::io_thread(bool restart_) : restart(restart_), evfd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), wakefd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+  {
+    if (evfd == -1 || wakefd == -1) [[unlikely]]
+      // This really should never happen.
+      ::error(EXIT_FAILURE, errno, "eventfd failed ?!");
+
+    // Only used to interrupt the wait in stop().
+    wake_source.fd = wakefd;
+    wake_source.cb = [](reactor::source& src, uint32_t) {
+      uint64_t cnt;
+      (void) ::read(src.fd, &cnt, sizeof(cnt));
+    };
+    ::epoll_event epev;
+    epev.events = EPOLLIN;
+    epev.data.ptr = &wake_source;
+    if (::epoll_ctl(rct.get_epfd(), EPOLL_CTL_ADD, wakefd, &epev) != 0) [[unlikely]]
+      ::error(EXIT_FAILURE, errno, "epoll_ctl failed");
+  }
+
+
+  io_thread::~io_thread()
+  {
+    stop();
+    ::close(wakefd);
+    ::close(evfd);
+  }
+
+
+  void io_thread::start()
+  {
+    assert(! thr.joinable());
+    stopping.store(false, std::memory_order_relaxed);
+    thr = std::thread([this] { run(); });
+  }
+
+
+  void io_thread::stop()
+  {
+    if (thr.joinable()) {
+      stopping.store(true, std::memory_order_relaxed);
+      uint64_t one = 1;
+      (void) ::write(wakefd, &one, sizeof(one));
+      thr.join();
+    }
+  }
+
+
+  void io_thread::run()
+  {
+    current_io_thread = this;
+    while (! stopping.load(std::memory_order_relaxed)) {
+      // Retry lines which did not fit into the queue after a short while.
+      rct.poll(pending.empty() ? -1 : 1, done);
+      if (! pending.empty()) {
+        auto n = std::ranges::find_if_not(pending, [this](line& l) { return push(l); }) - pending.begin();
+        pending.erase(pending.begin(), pending.begin() + n);
+      }
+    }
+    current_io_thread = nullptr;
+  }
+
+
+  void io_thread::done(handle& h, std::string_view text)
+  {
+    auto self = current_io_thread;
+    line l{&h, std::string(text)};
+    if (! self->pending.empty() || ! self->push(l))
+      self->pending.emplace_back(std::move(l));
+
+    if (self->restart) {
+      h.reset();
+      h.prepare();
+    }
+  }
+
+
+  bool io_thread::push(line& l)
+  {
+    auto tail = qtail.load(std::memory_order_relaxed);
+    if (tail - qhead.load(std::memory_order_acquire) == qsize)
+      return false;
+    queue[tail % qsize] = std::move(l);
+    qtail.store(tail + 1, std::memory_order_release);
+
+    uint64_t one = 1;
+    (void) ::write(evfd, &one, sizeof(one));
+    return true;
+  }
+
+
+  std::optional<io_thread::line> io_thread::pop()
+  {
+    auto head = qhead.load(std::memory_order_relaxed);
+    if (head == qtail.load(std::memory_order_acquire)) {
+      // Reset the eventfd before looking again so that no notification is lost.
+      uint64_t cnt;
+      (void) ::read(evfd, &cnt, sizeof(cnt));
+      if (head == qtail.load(std::memory_order_acquire))
+        return std::nullopt;
+    }
+    auto res = std::move(queue[head % qsize]);
+    qhead.store(head + 1, std::memory_order_release);
+    return res;
+  }
+
+
+  void handle::complete(uint64_t token, size_t start, std::vector<std::string>&& candidates)
+  {
+    std::lock_guard guard(compl_lock);
+    if (token != compl_token || complfd == -1)
+      return;
+    compl_start = start;
+    compl_candidates = std::move(candidates);
+    compl_ready = true;
+    uint64_t one = 1;
+    (void) ::write(complfd, &one, sizeof(one));
   }
 
 
   void handle::redraw()
   {
+    if (headless)
+      return;
+
     // Mark new prompt.
     if (osc133)
-      ::write(fd, osc133_L, strlen(osc133_L));
+      out(*this, osc133_L);
 
     if ((fl & handle::flags::frame) != handle::flags::none) {
-      std::string frame;
-
-      if (frame_highlight_fg != info->default_foreground)
-        frame = std::format("\e[m\e[38;2;{};{};{}m", frame_highlight_fg.r, frame_highlight_fg.g, frame_highlight_fg.b);
-      auto f = (fl & handle::flags::frame) == handle::flags::frame_line ? "─" : "\N{LOWER HALF BLOCK}";
-      for (size_t i = 0; i < term_cols; ++i)
-        frame.append(f);
-      frame.append("\n\n");
-      f = (fl & handle::flags::frame) == handle::flags::frame_line ? "─" : "\N{UPPER HALF BLOCK}";
-      for (size_t i = 0; i < term_cols; ++i)
-        frame.append(f);
-      if (frame_highlight_fg != info->default_foreground)
-        frame.append("\e[0m");
-      frame.append("\e[1F");
-
-      if (! colsel.empty())
-        frame.append(colsel);
-
-      ::write(fd, frame.data(), frame.size());
+      const auto& fr = frame_rows(*this);
+      out(*this, fr.color);
+      out(*this, fr.above);
+      out(*this, "\n\n");
+      out(*this, fr.below);
+      if (fr.highlight)
+        out(*this, "\e[0m");
+      out(*this, "\e[1F");
+
+      out(*this, colsel);
     }
 
     if (! prompt_str.empty()) {
       if (osc133)
-        ::write(fd, osc133_A, strlen(osc133_A));
-      std::string clean_prompt = colsel.empty() ? prompt_str : cleanup_CSI0m(prompt_str, colsel);
-      ::write(fd, clean_prompt.data(), clean_prompt.size());
+        out(*this, osc133_A);
+      if (colsel.empty())
+        out(*this, prompt_str);
+      else
+        cleanup_CSI0m(outbuf, prompt_str, colsel);
     }
     if (osc133)
-      ::write(fd, osc133_B, strlen(osc133_B));
+      out(*this, osc133_B);
 
     // Clear to end of line.  This also fills in the background color, if needed.
-    ::write(fd, "\e[K", 3);
+    out(*this, "\e[K");
 
     if (buffer.empty()) {
       show_empty_message(*this, get_empty_message());
@@ -1354,17 +5130,183 @@ namespace nrl {
       if (select_options.size() > 1)
         show_options(*this);
     } else {
-      ::write(fd, buffer.data(), buffer.size());
+      if (highlighter != nullptr && multiline) {
+        shadow.clear();
+        refresh_rows(*this, 0);
+      } else {
+        out_text(*this, prompt_len);
+        sync_shadow(*this, 0);
+      }
 
       assert(select_options.empty());
     }
+
+    flush_output(*this);
   }
 
 
   void handle::restore_color()
   {
-    if (! colsel.empty())
-      ::write(fd, colsel.data(), colsel.size());
+    if (headless)
+      return;
+
+    out(*this, colsel);
+    flush_output(*this);
+  }
+
+
+  bool predictor::apply(char op, std::string& to_terminal)
+  {
+    if (op == predict_left) {
+      if (cur.left == 0)
+        return false;
+      --cur.left;
+      ++cur.right;
+      --cur.col;
+      if (cur.end >= 0)
+        ++cur.end;
+      to_terminal.append("\e[D");
+    } else if (op == predict_right) {
+      if (cur.right == 0)
+        return false;
+      --cur.right;
+      ++cur.left;
+      ++cur.col;
+      if (cur.end > 0)
+        --cur.end;
+      to_terminal.append("\e[C");
+    } else {
+      // Only characters appended at the end of the text are predicted.
+      if (cur.end != 0 || cur.room == 0)
+        return false;
+      --cur.room;
+      ++cur.left;
+      ++cur.col;
+      to_terminal.push_back(op);
+    }
+    return true;
+  }
+
+
+  void predictor::user_input(std::string_view in, std::string& to_remote, std::string& to_terminal)
+  {
+    if (in.empty())
+      return;
+
+    batch b{next_token++, {}};
+    auto predicted = valid;
+    for (size_t i = 0; predicted && i < in.size(); ++i) {
+      auto op = in[i];
+      auto seq = in.substr(i, 3);
+      if (seq == "\e[D" || seq == "\eOD") {
+        op = predict_left;
+        i += 2;
+      } else if (seq == "\e[C" || seq == "\eOC") {
+        op = predict_right;
+        i += 2;
+      } else if (op < ' ' || op > '~') {
+        // Includes all bytes of multi-byte characters.
+        predicted = false;
+        break;
+      }
+      predicted = apply(op, to_terminal);
+      if (predicted)
+        b.ops.push_back(op);
+    }
+
+    if (predicted)
+      outstanding.push_back(std::move(b));
+    else {
+      // The remote side has to answer first.
+      valid = false;
+      blind_until = b.token;
+    }
+
+    to_remote.append(in);
+    to_remote.append("\e[");
+    append_num(to_remote, echo_mark);
+    to_remote.push_back(';');
+    append_num(to_remote, b.token);
+    to_remote.push_back('~');
+  }
+
+
+  void predictor::answer(std::string_view fields, std::string& to_terminal)
+  {
+    std::array<unsigned long, 6> v;
+    auto p = fields.data();
+    auto end = fields.data() + fields.size();
+    for (size_t i = 0; i < v.size(); ++i) {
+      auto [next, ec] = std::from_chars(p, end, v[i]);
+      if (ec != std::errc() || (i + 1 < v.size() ? next == end || *next != ';' : next != end)) [[unlikely]]
+        // Not an answer of a handle, ignore it.
+        return;
+      p = next + 1;
+    }
+
+    auto token = uint32_t(v[0]);
+    outstanding.erase(outstanding.begin(), std::ranges::find_if(outstanding, [token](const batch& b) { return b.token > token; }));
+    if (token < blind_until)
+      return;
+
+    cur = {unsigned(v[1]), unsigned(v[2]), unsigned(v[3]), unsigned(v[4]), unsigned(v[5]), v[5] > 0 ? 0 : -1};
+    valid = true;
+    if (outstanding.empty())
+      return;
+
+    // Show the predictions for the keys which have not been handled yet again.
+    csi_pos(to_terminal, cur.row, cur.col);
+    for (const auto& b : outstanding)
+      for (auto op : b.ops)
+        if (! apply(op, to_terminal)) {
+          valid = false;
+          blind_until = outstanding.back().token;
+          outstanding.clear();
+          return;
+        }
+  }
+
+
+  void predictor::remote_output(std::string_view in, std::string& to_terminal)
+  {
+    static constexpr std::string_view prefix = "\e]5150;";
+    // Longer sequences are no answers.
+    static constexpr size_t max_answer = 128;
+
+    auto from_held = ! held.empty();
+    if (from_held)
+      held.append(in);
+    std::string_view sv = from_held ? std::string_view(held) : in;
+    size_t done = 0;
+    size_t pos = 0;
+    size_t keep = sv.size();
+    while ((pos = sv.find('\e', pos)) != std::string_view::npos) {
+      auto rest = sv.substr(pos);
+      if (! rest.starts_with(prefix.substr(0, std::min(rest.size(), prefix.size())))) {
+        ++pos;
+        continue;
+      }
+      auto bel = rest.size() < prefix.size() ? std::string_view::npos : rest.substr(0, max_answer).find('\a');
+      if (bel == std::string_view::npos) {
+        if (rest.size() < max_answer) {
+          // The rest might arrive with the next output.
+          keep = pos;
+          break;
+        }
+        ++pos;
+        continue;
+      }
+      to_terminal.append(sv.substr(done, pos - done));
+      answer(rest.substr(prefix.size(), bel - prefix.size()), to_terminal);
+      pos += bel + 1;
+      done = pos;
+    }
+    to_terminal.append(sv.substr(done, keep - done));
+
+    if (from_held)
+      held.erase(0, keep);
+    else
+      held.assign(in.substr(keep));
   }
 
 } // namespace nrl
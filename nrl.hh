@@ -2,11 +2,19 @@
 #ifndef NRL_HH_
 # define NRL_HH_ 1
 
+# include <array>
+# include <atomic>
 # include <csignal> // IWYU pragma: keep
 # include <cstdint>
 # include <expected>
+# include <limits>
+# include <mutex>
+# include <optional>
 # include <string>
 # include <string_view>
+# include <thread>
+# include <tuple>
+# include <unordered_map>
 # include <utility>
 # include <variant>
 # include <vector>
@@ -22,6 +30,288 @@ namespace nrl {
 
   enum struct state { invalid, open, closed, archived };
 
+
+  /// Storage for the edited text.  The bytes are kept in a gap buffer so that insertions and
+  /// deletions at the cursor position do not have to move the rest of the text.  A contiguous
+  /// representation is only created when requested through view().  All offsets are byte
+  /// offsets into the logical text, the text is UTF-8 encoded.
+  struct gap_buffer {
+    size_t size() const { return store.size() - (gap_end - gap_start); }
+    bool empty() const { return size() == 0; }
+    uint8_t operator[](size_t i) const { return store[i < gap_start ? i : i + (gap_end - gap_start)]; }
+
+    void clear()
+    {
+      gap_start = 0;
+      gap_end = store.size();
+      ++nchanges;
+    }
+    void insert(size_t pos, const uint8_t* p, size_t n);
+    void insert(size_t pos, const std::string_view sv) { insert(pos, reinterpret_cast<const uint8_t*>(sv.data()), sv.size()); }
+    void append(const std::string_view sv) { insert(size(), sv); }
+    void assign(const std::string_view sv)
+    {
+      clear();
+      append(sv);
+    }
+    void erase(size_t from, size_t to);
+
+    /// Contiguous representation of the text.  This closes the gap if necessary.
+    std::string_view view();
+    /// The text in the range [FROM,TO) in at most two pieces, before and after the gap.
+    std::array<std::string_view, 2> segments(size_t from, size_t to) const;
+
+    /// Offset of the character following the one at POS.
+    size_t next(size_t pos) const;
+    /// Offset of the character preceding POS.
+    size_t prev(size_t pos) const;
+    /// Decoded character at POS.
+    uint32_t get(size_t pos) const;
+    /// Number of characters in the range [FROM,TO).
+    size_t nchars(size_t from, size_t to) const;
+    /// Counter incremented by every modification.  Can be used to detect changes.
+    uint64_t changes() const { return nchanges; }
+    /// Number of times the storage was enlarged.
+    uint64_t reallocations() const { return nreallocs; }
+
+  private:
+    void move_gap(size_t pos);
+    void grow(size_t n);
+
+    std::vector<uint8_t> store{};
+    size_t gap_start = 0;
+    size_t gap_end = 0;
+    uint64_t nchanges = 0;
+    uint64_t nreallocs = 0;
+  };
+
+  /// Input history.  The entries are lines of text.  If a file is used, entries are only ever
+  /// appended to it and the file is mapped into memory, so several processes can share it.
+  /// Entries added by other processes become visible after refresh().  Without a file the
+  /// history is only kept in memory.  An index of the entry starts allows direct access to
+  /// each entry.  The string_view objects returned are invalidated by add() and refresh().  Line
+  /// breaks in entries are stored as carriage returns.
+  struct history {
+    history() = default;
+    history(const history&) = delete;
+    history& operator=(const history&) = delete;
+    ~history();
+
+    /// Use the file at PATH, creating it if necessary.  On failure false is returned and errno
+    /// is set; the history is then kept in memory.
+    bool open(const std::string& path);
+
+    /// Add LINE as the newest entry unless it is the same as the newest entry.
+    void add(std::string_view line);
+    /// Pick up entries appended to the file by other processes.  If the file got shorter all
+    /// entries are read again.  The file is mapped into memory: if another process truncates it
+    /// while an entry is accessed, between two calls of refresh, the access can raise SIGBUS.
+    void refresh();
+
+    size_t size() const { return starts.size(); }
+    bool empty() const { return starts.empty(); }
+    /// Entry IDX, the oldest entry has index zero.
+    std::string_view operator[](size_t idx) const;
+
+    /// Find the newest entry with index lower than BEFORE which contains NEEDLE.  The index of
+    /// the entry and the offset of the match in it are returned.
+    std::optional<std::tuple<size_t, size_t>> search(std::string_view needle, size_t before) const;
+
+  private:
+    std::string_view data() const { return fd == -1 ? std::string_view(mem) : std::string_view(map, mapped); }
+    void index_new();
+
+    int fd = -1;
+    const char* map = nullptr;
+    size_t mapped = 0;
+    std::string mem{};
+    // Start offsets of the entries.  Each entry is terminated by a newline character.
+    std::vector<size_t> starts{};
+    // Number of bytes covered by the index.
+    size_t indexed = 0;
+  };
+
+
+  /// Ring of killed text which can be yanked.  The text is kept in storage of fixed capacity, the
+  /// oldest entries are dropped when room is needed.  Longer text is cut off.  A kill ring can be
+  /// shared by several handles, for instance all handles driven by a reactor, which then must be
+  /// used from the same thread.
+  struct kill_ring {
+    explicit kill_ring(size_t capacity = 65536, size_t max_entries = 64);
+    kill_ring(const kill_ring&) = delete;
+    kill_ring& operator=(const kill_ring&) = delete;
+
+    /// Add TEXT as the most recent entry.  If APPEND is true the text is added to the most recent
+    /// entry instead, at its end or, if BEFORE is true, in front of it.
+    void add(std::string_view text, bool append = false, bool before = false);
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    /// Entry IDX, zero is the most recent.  The text is returned in two pieces since the storage
+    /// wraps around.  The pieces are invalidated by add().
+    std::array<std::string_view, 2> operator[](size_t idx) const;
+
+    /// The ring used by handles for which no other ring is set.
+    static kill_ring& defaults();
+
+  private:
+    void store_text(std::string_view text);
+
+    // START counts all bytes ever stored, the position in STORE is START modulo its size.
+    struct entry {
+      size_t start;
+      size_t len;
+    };
+    std::vector<char> store;
+    // Used as a ring as well.  The oldest entry is at index HEAD.
+    std::vector<entry> entries;
+    size_t head = 0;
+    size_t count = 0;
+    size_t end = 0;
+    std::string scratch{};
+  };
+
+
+  struct handle;
+
+
+  /// Key bindings.  Symbolic keys and ASCII characters are looked up with a direct table access
+  /// indexed by modifier and key code.  Other characters, which can only have user-defined
+  /// bindings, use a hash table.  All lookups are O(1).
+  struct keymap {
+    /// Functions bound to keys return true if the input is complete.
+    using function = bool (*)(handle&);
+
+    /// Modifiers used are the combinations of TERMKEY_KEYMOD_SHIFT, TERMKEY_KEYMOD_ALT, TERMKEY_KEYMOD_CTRL.
+    static constexpr unsigned nmods = 8;
+    static constexpr unsigned ncodes = 128;
+
+    struct tables {
+      std::array<std::array<function, TERMKEY_N_SYMS>, nmods> syms;
+      std::array<std::array<function, ncodes>, nmods> codes;
+    };
+
+    /// A new keymap starts with the default bindings.
+    keymap();
+
+    /// Bind FCT to a key.  For symbolic keys (SYM true) CODE is a TermKeySym value, otherwise a
+    /// Unicode codepoint.  MOD is a combination of TERMKEY_KEYMOD_* values.  Passing a null
+    /// pointer for FCT removes the binding.
+    void bind(bool sym, int mod, long code, function fct);
+    function lookup(bool sym, int mod, long code) const;
+
+    /// The default bindings.  The functions can be retrieved with lookup() to bind them to other keys.
+    static const keymap& defaults();
+
+  private:
+    tables t;
+    std::unordered_map<uint64_t, function> others{};
+  };
+
+
+  /// Drive many handles with a single epoll descriptor and a single signal descriptor for
+  /// SIGWINCH.  The epoll data of all registered descriptors are pointers to source objects so
+  /// that events are dispatched in constant time.  When the window size changes all handles are
+  /// notified since the signal does not tell which terminal changed.
+  struct reactor {
+    /// Target of an epoll registration.  Descriptors of the program can be registered with the
+    /// reactor's epoll descriptor as well, using a source object with a null handle pointer and
+    /// a callback which is called with the events.
+    struct source {
+      handle* h = nullptr;
+      int fd = -1;
+      void (*cb)(source& src, uint32_t events) = nullptr;
+    };
+
+    reactor();
+    reactor(const reactor&) = delete;
+    reactor& operator=(const reactor&) = delete;
+    ~reactor();
+
+    /// The handles must be created with this descriptor.
+    int get_epfd() const { return epfd; }
+
+    /// Drive H.  This must happen before the first prepare() call for the handle.
+    void add(handle& h);
+    /// Stop driving H.  This can be called from the callback of poll().
+    void remove(handle& h);
+
+    /// Called when a handle completed its input.
+    using done_callback = void (*)(handle& h, std::string_view text);
+    /// Wait at most TIMEOUT milliseconds (-1 for no limit) for events and handle them.  Returns
+    /// the number of events or -1 on error.
+    int poll(int timeout, done_callback done);
+
+  private:
+    int epfd;
+    int sigfd;
+    sigset_t old_mask{};
+    source sig_source{};
+    std::vector<handle*> handles{};
+    std::array<::epoll_event, 64> events{};
+    int nevents = 0;
+    int next_event = 0;
+  };
+
+
+  /// Run the event loop of a reactor on a background thread so that input is handled while the
+  /// application is busy.  Completed lines are passed to the application through a lock-free
+  /// single-producer, single-consumer queue.  The eventfd returned by get_fd() is readable while
+  /// lines are available; it can be registered with the application's own event loop.
+  ///
+  /// The handles must be created with the epoll descriptor of the reactor and added before
+  /// start().  Once the thread runs they must not be used by other threads until stop()
+  /// returned.  All handle functions, including the string_callback functions for prompt and
+  /// answer, are then called on the I/O thread.  If RESTART is true a handle whose input is
+  /// complete is reset and prepared again on the I/O thread right away.  Since SIGWINCH must be
+  /// blocked in all threads the object has to be created before the application starts other
+  /// threads.
+  struct io_thread {
+    /// A completed input.
+    struct line {
+      handle* h = nullptr;
+      std::string text{};
+    };
+
+    explicit io_thread(bool restart_ = true);
+    io_thread(const io_thread&) = delete;
+    io_thread& operator=(const io_thread&) = delete;
+    ~io_thread();
+
+    int get_epfd() const { return rct.get_epfd(); }
+    void add(handle& h) { rct.add(h); }
+
+    void start();
+    /// Stop the thread and wait for it to terminate.
+    void stop();
+
+    int get_fd() const { return evfd; }
+    /// The next completed line, if there is one.  Only one thread must call this function.
+    std::optional<line> pop();
+
+  private:
+    void run();
+    static void done(handle& h, std::string_view text);
+    bool push(line& l);
+
+    reactor rct{};
+    bool restart;
+    int evfd;
+    int wakefd;
+    reactor::source wake_source{};
+    std::atomic<bool> stopping{false};
+    std::thread thr{};
+
+    // The queue.  QHEAD is advanced by the consumer, QTAIL by the I/O thread.  Lines which do not
+    // fit are kept in PENDING by the I/O thread.
+    static constexpr size_t qsize = 64;
+    std::array<line, qsize> queue{};
+    alignas(64) std::atomic<size_t> qhead{0};
+    alignas(64) std::atomic<size_t> qtail{0};
+    std::vector<line> pending{};
+  };
+
+
   struct handle {
     /// Screen management interface for handling scrolling and line preservation
     struct screen_manager {
@@ -29,23 +319,30 @@ namespace nrl {
       /// @return Number of rows that should not be scrolled off screen
       virtual unsigned get_fixed_rows() const = 0;
 
-      /// Insert or delete lines at current cursor position
+      /// Insert or delete lines at current cursor position.  The handle collects its output in
+      /// a buffer; before a screen manager other than the default one is called the buffer is
+      /// written to the terminal so that the manager can write its sequences directly.
       /// @param delta Number of lines to insert (positive) or delete (negative)
       virtual void adjust_lines(int delta) = 0;
 
+      /// Position of the cursor, if known to the screen manager.  This avoids querying the terminal.
+      /// @return Column and row (both starting at 1) or nothing
+      virtual std::optional<std::tuple<unsigned, unsigned>> get_cursor_pos() const { return std::nullopt; }
+
       virtual ~screen_manager() = default;
     };
 
     /// Default screen manager implementation
     struct default_screen_manager final : screen_manager {
-      int fd;
+      handle& h;
 
-      explicit default_screen_manager(int fd_) : fd{fd_} {}
+      explicit default_screen_manager(handle& h_) : h{h_} {}
 
       /// Returns 0 to match current behavior (no fixed rows)
       unsigned get_fixed_rows() const override;
 
-      /// Insert or delete lines using CSI escape sequences
+      /// Insert or delete lines using CSI escape sequences.  The sequences are added to the
+      /// output of the handle.
       void adjust_lines(int delta) override;
     };
 
@@ -62,19 +359,54 @@ namespace nrl {
     handle& operator=(const handle&) = delete;
     ~handle();
 
+    /// Read one input.  In headless mode the result points into the input buffer, see HEADLESS.
     std::string_view read();
 
     void prepare();
     void prepare(const std::vector<std::string>& select, bool multi_ = false);
+    /// Make an archived handle usable for the next input which is started with prepare().  If the
+    /// handle is reusable the terminal and signal descriptors and their epoll registration are kept.
+    void reset();
     std::expected<std::string_view, bool> process(::epoll_event& epev);
     void redraw();
 
     void adjust_start(int delta) { initial_row += delta; }
 
+    /// Counters of the work done by the handle.  They are only maintained if nrl is configured
+    /// with NRL_STATS, otherwise all values but the buffer reallocations are zero.
+    struct statistics {
+      uint64_t keys = 0;              // Key strokes handled.
+      uint64_t writes = 0;            // System calls writing terminal output
+      uint64_t bytes_written = 0;     // and the bytes written by them.
+      uint64_t line_offset_calls = 0; // Recomputations of the line starts
+      uint64_t line_offset_bytes = 0; // and the bytes scanned for them.
+      uint64_t redisplays = 0;
+      uint64_t reallocations = 0; // Enlargements of the buffer storage.
+      uint64_t events = 0;        // Events passed to process()
+      uint64_t process_ns = 0;    // and the time spent handling them
+      uint64_t process_max_ns = 0; // with the maximum for a single event.
+    };
+    statistics stats() const
+    {
+      auto res = counters;
+      res.reallocations = buffer.reallocations();
+      return res;
+    }
+
+    /// Notify the handle that the window size might have changed.  With the reactor and the
+    /// handle's own signal descriptor this happens automatically.  While the input is shown the
+    /// notifications are coalesced, the new size is applied at most once every RESIZE_INTERVAL
+    /// milliseconds when the event for the resize timer is passed to process().
+    void window_changed();
+    unsigned resize_interval = 16;
+
     void restore_color();
 
     bool active_p() const { return term_state == state::closed || term_state == state::open; }
 
+    /// Functions computing the prompt or answer text.  They are called from the thread using the
+    /// handle (prepare(), process(), redraw()), with io_thread this is the I/O thread.  The
+    /// returned string must remain valid until the next call.
     using string_callback = const char* (*) ();
 
     void set_prompt(std::string&& s);
@@ -87,11 +419,32 @@ namespace nrl {
     void set_answer(const std::string_view s);
     void set_answer(string_callback prompt_fct);
 
-    std::vector<uint8_t> buffer{};
+    gap_buffer buffer{};
     std::vector<unsigned> line_offset{0};
+    // Number of columns used by the text of each row of line_offset, without the prompt and the
+    // line break.  Not used in single-line mode where row 0 is a scrolled window.
+    std::vector<unsigned> row_cols{0};
+    // The logical lines, separated by line breaks, start at the rows of line_offset listed here.
+    // A line break is the last byte of its row.
+    std::vector<unsigned> logical{0};
+    // Reused for the rows computed when a logical line is wrapped again.
+    std::vector<unsigned> rows_scratch{};
+    std::vector<unsigned> row_cols_scratch{};
+    // With the column model the text of a row is copied here to find its grapheme clusters.
+    std::string cluster_text{};
+    std::string cluster_breaks{};
+    // True once the buffer can contain a character which does not take exactly one column of its
+    // own, a wide character or one forming a grapheme cluster with its neighbors.  Rows are then
+    // filled according to the width of the clusters and the cursor moves over whole clusters.
+    // Only used if multiline is set, the single row otherwise shown refuses such characters when
+    // they are typed, pasted, yanked, completed, or recalled from the history.
+    bool wide = false;
     size_t filled = 0;
     size_t returned = 0;
     size_t max_lines = 1;
+    // Model of the screen rows showing the buffer, one entry per element of line_offset with the
+    // bytes currently visible in that row.  Empty if the screen content is unknown.
+    std::vector<std::string> shadow{};
     std::variant<std::monostate, std::string, string_callback> prompt{};
     std::variant<std::monostate, std::string, string_callback> answer{};
 
@@ -100,6 +453,25 @@ namespace nrl {
 
     std::vector<std::string> select_options{};
     size_t select_idx = 0;
+    // The menu shows MENU_HEIGHT options starting with index MENU_FIRST.
+    size_t menu_first = 1;
+    size_t menu_height = 0;
+
+    /// If true the text typed narrows the options shown in the menu of prepare() to those which
+    /// contain the text as a subsequence, ignoring ASCII case, best matches first.
+    bool filter = false;
+    // While FILTERED is true the menu shows the options with the indices in MATCHES.  The options
+    // are indexed in FILTER_LOWER (lowercased, back to back, starting at the offsets in
+    // FILTER_STARTS) and FILTER_MASKS (characters present).  FILTER_QUERY is the text the matches
+    // were computed for.
+    bool filtered = false;
+    std::string filter_lower{};
+    std::vector<uint32_t> filter_starts{};
+    std::vector<uint64_t> filter_masks{};
+    std::string filter_query{};
+    std::vector<uint32_t> matches{};
+    std::vector<std::pair<int, uint32_t>> filter_scratch{};
+    uint64_t filter_changes = 0;
     std::set<size_t> selected{};
     bool multi = false;
     inline static constexpr char select_sep[] = "\N{NO-BREAK SPACE}&\N{NO-BREAK SPACE}";
@@ -108,9 +480,147 @@ namespace nrl {
 
     void set_screen_manager(screen_manager* mgr);
 
+    /// Use a different set of key bindings.  The keymap must remain valid as long as it is used.
+    void set_keymap(const keymap& km) { keys = &km; }
+    const keymap* keys = &keymap::defaults();
+
+    /// Tell the handle where the cursor is (column and row, starting at 1).  The next prepare()
+    /// then does not have to query the terminal.  With finalize_pos set finalize() sets the
+    /// position itself, code writing to the terminal between two inputs must then update or reset
+    /// cursor_hint.
+    void set_cursor_pos(unsigned col, unsigned row) { cursor_hint.emplace(col, row); }
+    std::optional<std::tuple<unsigned, unsigned>> cursor_hint{};
+
+    /// Use HIST for recalling earlier input (Ctrl-P/Ctrl-N, Up/Down at the first/last row) and
+    /// for reverse incremental search (Ctrl-R).  Completed input is added to it.  Passing a null
+    /// pointer disables the history.  The object must remain valid as long as it is used.
+    void set_history(history* hist_) { hist = hist_; }
+    history* hist = nullptr;
+    // Index of the history entry shown.  The maximal value denotes the edited line which is saved
+    // in HIST_LINE while other entries are shown.
+    size_t hist_idx = std::numeric_limits<size_t>::max();
+    std::string hist_line{};
+    // Reverse incremental search.  SEARCH_IDX is the entry with the current match.
+    bool searching = false;
+    std::string search_str{};
+    size_t search_idx = 0;
+    // Length of the search string if the last search failed, otherwise zero.  Extending the string
+    // cannot produce a match, only Backspace or Ctrl-R search again.
+    size_t search_failed = 0;
+
+    // Undo journal (Ctrl-_ undoes, Alt-Ctrl-_ redoes).  Each record describes one edit: at OFFSET
+    // NREMOVED bytes were replaced by NINSERTED bytes.  Both texts are stored back to back at
+    // offset TEXT of JOURNAL_TEXT, the removed text first.  CURSOR is the cursor position before the
+    // edit.  Records before JOURNAL_POS are applied, the others can be redone until the next edit.
+    // Consecutive typed characters extend the last record.  The values have 32 bits, an edit of a
+    // larger buffer clears the journal.
+    struct edit_record {
+      uint32_t offset;
+      uint32_t text;
+      uint32_t nremoved;
+      uint32_t ninserted;
+      uint32_t cursor;
+      bool typed;
+    };
+    std::vector<edit_record> journal{};
+    std::string journal_text{};
+    size_t journal_pos = 0;
+
+    /// Use KR for killed text (Ctrl-K, Ctrl-U, Ctrl-W, Alt-D) and yanking (Ctrl-Y, Alt-Y).  By
+    /// default all handles share kill_ring::defaults().  The ring must remain valid as long as it
+    /// is used.
+    void set_kill_ring(kill_ring& kr) { kills = &kr; }
+    kill_ring* kills = &kill_ring::defaults();
+    // Serial number of the key handled.  Successive kills are added to the same entry and
+    // Alt-Y only works directly after a yank which is recognized by the serial numbers of the
+    // last kill and yank.  The text of the last yank is at YANK_START, YANK_IDX is the entry.
+    uint64_t key_serial = 0;
+    uint64_t kill_serial = 0;
+    uint64_t yank_serial = 0;
+    size_t yank_idx = 0;
+    size_t yank_start = 0;
+    size_t yank_len = 0;
+
+    /// Part of a screen row of the buffer shown in a different style.  FROM and TO are byte
+    /// offsets relative to the start of the row.
+    struct style_span {
+      unsigned from;
+      unsigned to;
+      terminal::info::color fg;
+      bool bold = false;
+
+      bool operator==(const style_span&) const = default;
+    };
+    /// Syntax highlighting, only used in multi-line mode.  The callback is called for each screen
+    /// row of the buffer with the text of the row and the STATE the call for the previous row
+    /// returned (zero for the first row).  It appends the spans for the row, ordered and not
+    /// overlapping, to SPANS and returns the state at the end of the row, for instance whether a
+    /// string literal is still open.  The results are cached, the callback is called again only
+    /// for rows whose text or start state changed.
+    using highlight_callback = unsigned (*)(handle& h, std::string_view row, unsigned state, std::vector<style_span>& spans);
+    void set_highlighter(highlight_callback cb)
+    {
+      highlighter = cb;
+      hl_rows.clear();
+      shadow.clear();
+    }
+    highlight_callback highlighter = nullptr;
+    // Cached highlighting result for each row.  DIRTY is set when the spans changed and the row has
+    // not been redrawn yet.
+    struct highlight_row {
+      std::string text{};
+      unsigned start_state = 0;
+      unsigned end_state = 0;
+      std::vector<style_span> spans{};
+      bool dirty = true;
+    };
+    std::vector<highlight_row> hl_rows{};
+    std::vector<style_span> hl_spans{};
+
+    /// Tab completion.  When Tab is pressed CB is called with the text of the buffer, the cursor
+    /// offset, and a token.  TEXT points into the edit buffer and is only valid during the call, a
+    /// request handed to another thread must contain a copy.  The callback must not block.  It can
+    /// compute the candidates right away, hand the request to another thread, or send a request
+    /// through a descriptor the caller watches with the same epoll descriptor.  In any case the
+    /// result is delivered by calling complete() with the token, possibly from another thread.  The
+    /// result is shown when the event for the handle's completion descriptor is passed to
+    /// process().  Results are dropped if the buffer or cursor changed in the meantime or the input
+    /// is finished.
+    using completion_callback = void (*)(handle& h, std::string_view text, size_t offset, uint64_t token);
+    void set_completion(completion_callback cb) { completion = cb; }
+    /// Deliver the CANDIDATES for the request identified by TOKEN.  Each candidate replaces the
+    /// text from byte offset START to the cursor.  This function can be called from any thread as
+    /// long as the handle exists.
+    void complete(uint64_t token, size_t start, std::vector<std::string>&& candidates);
+    completion_callback completion = nullptr;
+    // Eventfd registered with EPFD, signaled by complete().
+    int complfd = -1;
+    // The result of complete() is stored under COMPL_LOCK.  COMPL_TOKEN identifies the current
+    // request, COMPL_CHANGES and COMPL_OFFSET the state of the buffer at the time of the request.
+    std::mutex compl_lock{};
+    uint64_t compl_token = 0;
+    uint64_t compl_changes = 0;
+    size_t compl_offset = 0;
+    bool compl_ready = false;
+    size_t compl_start = 0;
+    std::vector<std::string> compl_candidates{};
+    // True while the candidates are shown in the options menu.
+    bool completing = false;
+
     int fd;
     flags fl;
+    /// True if FD is not a terminal, for instance for scripted or piped input.  Then there is no
+    /// termkey object, the terminal is not queried, and nothing is written.  The input is read in
+    /// large blocks and each line is returned as one input, without the newline.  The string_view
+    /// returned by process() or read() points into the input buffer.  It remains valid until the
+    /// next call of process() or read().  INPUT_EOF is set once the input ended; from then on
+    /// empty lines are returned.
+    bool headless;
+    bool input_eof = false;
     state term_state = state::invalid;
+    // Entry of the process-wide terminal cache the information comes from, if any.
+    struct terminal_entry;
+    std::shared_ptr<terminal_entry> term_entry;
     std::shared_ptr<terminal::info> info;
 
     unsigned term_rows = 0;
@@ -126,16 +636,114 @@ namespace nrl {
 
     sigset_t old_mask{};
     int sigfd = -1;
+    // Timer descriptor armed by window_changed().  RESIZE_PENDING is true while it is armed.
+    int resizefd = -1;
+    bool resize_pending = false;
 
     int epfd;
     bool extern_epfd;
 
+    // If the handle is driven by a reactor, the epoll data point to these sources and there is no
+    // signal descriptor of the handle.
+    reactor* rct = nullptr;
+    reactor::source tk_source{};
+    reactor::source compl_source{};
+    reactor::source resize_source{};
+
+    /// Use io_uring for reading from and writing to the terminal if nrl is built with support for
+    /// it.  Must be set before the first prepare() call.  Instead of the termkey descriptor an
+    /// eventfd signaled for the completions is then registered with the epoll descriptor, the
+    /// events for it are passed to process() as usual.
+    bool use_uring = false;
+    struct uring_state;
+    std::unique_ptr<uring_state> uring;
+
+    // If true, finalizing the input does not release the termkey object, signal descriptor, and the
+    // epoll registrations.  The handle can be used again after a call to reset().  The terminal
+    // stays in the mode set by termkey and SIGWINCH stays blocked until the handle is destroyed.
+    bool reusable = false;
+    bool fds_registered = false;
+    bool colors_ready = false;
+
+    // Terminal output accumulated while handling an event.  It is written with a single system
+    // call at the end.  OUTBUF_WRITTEN is the part already written in case the terminal did not
+    // accept all data.  In this case EPOLLOUT is requested for TKFD as long as WANT_OUTPUT is true.
+    std::string outbuf{};
+    size_t outbuf_written = 0;
+    bool want_output = false;
+
+    // Input of the headless mode.  The lines between IN_START and IN_END are not returned yet,
+    // the bytes before IN_SCAN contain no newline.  Instead of termkey's descriptor an eventfd is
+    // the input descriptor.  It is kept readable (IN_READY) while an input can be returned
+    // without waiting for FD, because lines are buffered or FD cannot be used with epoll
+    // (IN_POLLABLE false, for instance for regular files).  The registration of FD is disabled
+    // only when an event arrives while no input is prepared (IN_SUSPENDED).
+    std::string inbuf{};
+    size_t in_start = 0;
+    size_t in_scan = 0;
+    size_t in_end = 0;
+    bool in_pollable = true;
+    bool in_ready = false;
+    bool in_suspended = false;
+
+    // See stats().
+    statistics counters{};
+    // Reused for output composed before it is added to OUTBUF so that no memory is allocated
+    // in the steady state.
+    std::string scratch{};
+
+    /// Use REP (CSI n b) to draw the frame rows with a few bytes instead of repeating the glyph
+    /// for each column.  Only set this if the terminal supports the sequence.
+    bool rep = false;
+    // The rendered frame rows: the color selection, the rows above and below the input, and the
+    // row below without highlighting.  They are rebuilt when the width, the frame style, the
+    // color, or REP change.
+    struct frame_render {
+      unsigned cols = 0;
+      flags style = flags::none;
+      terminal::info::color fg{};
+      bool highlight = false;
+      bool rep = false;
+      std::string color{};
+      std::string above{};
+      std::string below{};
+      std::string plain{};
+    };
+    frame_render frame_cache{};
+
     // True if not scrolling but multi-line input is requested.
     bool multiline = true;
+    /// Allow line breaks in the input.  This only works in multi-line mode and without options.
+    /// Alt-Enter inserts a line break and line breaks in pasted text are kept.  If a completeness
+    /// callback is set, Enter only finishes the input if the callback returns true for the text,
+    /// otherwise it inserts a line break as well.
+    bool line_breaks = false;
+    using input_complete_callback = bool (*)(handle& h, std::string_view text);
+    void set_input_complete(input_complete_callback cb) { input_complete = cb; }
+    input_complete_callback input_complete = nullptr;
     // True if insert mode, false if overwrite.
     bool insert = true;
     // Use OSC 133 semantic prompts.
     bool osc133 = false;
+    /// Answer the marks of a predictor on the terminal side, see nrl::predictor, with the state
+    /// needed for predictive local echo.
+    bool echo_hints = false;
+    // If the position is not known, do not wait for the answer of the terminal to the position
+    // request in prepare().  The answer is handled in process() instead and key strokes before it
+    // are delayed.  This uses DECXCPR which the terminal must support.
+    bool async_pos = false;
+    // Let finalize() set cursor_hint to the row after the input so that the next prepare() does not
+    // have to ask the terminal.  Only useful if nothing else writes to the terminal in between.
+    bool finalize_pos = false;
+    bool awaiting_pos = false;
+    std::vector<TermKeyKey> pending_keys{};
+
+    // Bracketed paste.  While PASTING is true the pasted text is collected in PASTE and inserted
+    // into the buffer at once when the paste ends.  At most MAX_PASTE bytes are accepted, the
+    // rest of the paste is dropped.
+    bool pasting = false;
+    std::string paste{};
+    size_t max_paste = std::numeric_limits<size_t>::max();
 
     // Up-to-date in read calls.
     unsigned initial_col = 0;
@@ -155,9 +763,74 @@ namespace nrl {
 
   private:
     void prepare_();
+    std::expected<std::string_view, bool> process_(::epoll_event& epev);
+  };
+
+
+  /// Predictive local echo for high-latency links, in the style of mosh.  A companion program on
+  /// the terminal side forwards the key strokes to the program using a handle on the remote side
+  /// and the output of the remote side to the terminal.  It passes both through a predictor which
+  /// shows characters appended at the end of the text and cursor motion within a row right away.
+  ///
+  /// After each batch of key strokes the predictor sends the mark CSI 5150;N~ with a serial number
+  /// N.  A handle with echo_hints set answers it with OSC 5150;N;ROW;COL;LEFT;RIGHT;ROOM BEL after
+  /// the output for the keys before the mark: the cursor position, how many columns the cursor can
+  /// move left and right in its row, and how many characters can be appended if the cursor is at
+  /// the end of the text.  All but the position are zero if no prediction is safe, for instance
+  /// with a highlighter, with options, or with line breaks and wide characters in the text.  The
+  /// answer is authoritative: the predictions for the keys before the mark are dropped, those for
+  /// later keys are shown again on top of the new state.  Any other key stops the predictions
+  /// until the answer to the mark following it arrives.
+  struct predictor {
+    /// Pass the key strokes IN typed by the user.  The bytes for the remote side, including the
+    /// mark, are appended to TO_REMOTE, the speculative output to TO_TERMINAL.
+    void user_input(std::string_view in, std::string& to_remote, std::string& to_terminal);
+    /// Pass the output IN of the remote side.  It is appended to TO_TERMINAL without the answers
+    /// to the marks, each answer is followed by the predictions which are not yet confirmed.
+    void remote_output(std::string_view in, std::string& to_terminal);
+
+  private:
+    // What can be predicted, from the last answer and the predictions since.  END is the distance
+    // of the cursor from the end of the text if it is known, otherwise negative.
+    struct state {
+      unsigned row = 0;
+      unsigned col = 0;
+      unsigned left = 0;
+      unsigned right = 0;
+      unsigned room = 0;
+      int end = -1;
+    };
+    // The predicted key strokes of the batch with mark TOKEN: printable characters are appended,
+    // the other values are cursor motions.
+    struct batch {
+      uint32_t token;
+      std::string ops;
+    };
+
+    bool apply(char op, std::string& to_terminal);
+    void answer(std::string_view fields, std::string& to_terminal);
+
+    state cur{};
+    // Predictions are only made once the answer to mark BLIND_UNTIL arrived.
+    bool valid = false;
+    uint32_t blind_until = 0;
+    uint32_t next_token = 1;
+    std::vector<batch> outstanding{};
+    // Incomplete answer at the end of the last remote output.
+    std::string held{};
   };
 
 
+  /// Information about the terminal FD refers to.  The terminal is probed only once per process,
+  /// identified by the device and the TERM environment variable.  The result is shared between
+  /// all handles which are created without explicitly passing the information.
+  std::shared_ptr<terminal::info> get_terminal_info(int fd);
+
+  /// Forget the cached information about the terminal FD refers to.  This happens automatically
+  /// when the window size changes since it might indicate that a different terminal is used.
+  void invalidate_terminal_info(int fd);
+
+
   inline handle::flags operator&(handle::flags l, handle::flags r)
   {
     return static_cast<handle::flags>(std::to_underlying(l) & std::to_underlying(r));
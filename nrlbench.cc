@@ -0,0 +1,357 @@
+#include "nrl.hh"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+#include <locale>
+#include <memory>
+#include <new>
+#include <print>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <error.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+
+// The handle works on the slave side of a pseudo terminal.  The benchmark plays the terminal on
+// the master side: it writes the key strokes and consumes the output.  The system calls made by
+// nrl and termkey while processing are counted by the definitions of the functions below which
+// take precedence over those of the C library.  Only calls through these interfaces are seen.
+// Memory allocations are counted by the replacement of the global operator new.
+namespace {
+
+  bool counting = false;
+  uint64_t nsyscalls = 0;
+  uint64_t nallocs = 0;
+  int slave_fd = -1;
+  // Bytes read from and written to the slave side.
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+
+
+  void count_call()
+  {
+    if (counting)
+      ++nsyscalls;
+  }
+
+} // anonymous namespace
+
+
+void* operator new(size_t n)
+{
+  if (counting)
+    ++nallocs;
+  if (auto res = std::malloc(n == 0 ? 1 : n); res != nullptr)
+    return res;
+  throw std::bad_alloc();
+}
+
+
+void* operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
+
+void operator delete[](void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+
+extern "C" ssize_t read(int fd, void* buf, size_t n)
+{
+  count_call();
+  auto res = ::syscall(SYS_read, fd, buf, n);
+  if (fd == slave_fd && res > 0)
+    bytes_in += res;
+  return res;
+}
+
+
+extern "C" ssize_t write(int fd, const void* buf, size_t n)
+{
+  count_call();
+  auto res = ::syscall(SYS_write, fd, buf, n);
+  if (fd == slave_fd && res > 0)
+    bytes_out += res;
+  return res;
+}
+
+
+extern "C" ssize_t writev(int fd, const ::iovec* iov, int iovcnt)
+{
+  count_call();
+  auto res = ::syscall(SYS_writev, fd, iov, iovcnt);
+  if (fd == slave_fd && res > 0)
+    bytes_out += res;
+  return res;
+}
+
+
+extern "C" int ioctl(int fd, unsigned long req, ...) noexcept
+{
+  count_call();
+  va_list ap;
+  va_start(ap, req);
+  auto arg = va_arg(ap, void*);
+  va_end(ap);
+  return ::syscall(SYS_ioctl, fd, req, arg);
+}
+
+
+extern "C" int fcntl(int fd, int cmd, ...)
+{
+  count_call();
+  va_list ap;
+  va_start(ap, cmd);
+  auto arg = va_arg(ap, long);
+  va_end(ap);
+  return ::syscall(SYS_fcntl, fd, cmd, arg);
+}
+
+
+extern "C" int poll(::pollfd* fds, ::nfds_t nfds, int timeout)
+{
+  count_call();
+  return ::syscall(SYS_poll, fds, nfds, timeout);
+}
+
+
+extern "C" int epoll_ctl(int epfd, int op, int fd, ::epoll_event* ev) noexcept
+{
+  count_call();
+  return ::syscall(SYS_epoll_ctl, epfd, op, fd, ev);
+}
+
+
+namespace {
+
+  // A sequence of key strokes fed to a fresh input.  The SETUP keys are not measured, each element
+  // of KEYS is measured as one key stroke.  The input is finished with Enter afterwards.
+  struct scenario {
+    const char* name;
+    bool multiline;
+    std::vector<std::string> options;
+    std::vector<std::string> setup;
+    std::vector<std::string> keys;
+  };
+
+
+  struct result {
+    std::vector<uint64_t> latency_ns{};
+    uint64_t syscalls = 0;
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+  };
+
+
+  std::string text(size_t n)
+  {
+    static constexpr std::string_view words = "the quick brown fox jumps over the lazy dog 0123456789 ";
+    std::string res;
+    while (res.size() < n)
+      res += words.substr(0, std::min(words.size(), n - res.size()));
+    return res;
+  }
+
+
+  std::string pasted(size_t n) { return "\e[200~" + text(n) + "\e[201~"; }
+
+
+  std::vector<std::string> chars(const std::string& s)
+  {
+    std::vector<std::string> res;
+    for (auto c : s)
+      res.emplace_back(1, c);
+    return res;
+  }
+
+
+  std::vector<std::string> repeat(const std::string& key, size_t n) { return std::vector<std::string>(n, key); }
+
+
+  std::vector<scenario> scenarios()
+  {
+    std::vector<scenario> res;
+    res.push_back({"typing", true, {}, {}, chars(text(1600))});
+    res.push_back({"typing-scroll", false, {}, {}, chars(text(1600))});
+    res.push_back({"paste", true, {}, {}, repeat(pasted(64), 25)});
+    res.push_back({"paste-long", false, {}, {}, repeat(pasted(4000), 10)});
+    res.push_back({"backspace-long", false, {}, {pasted(8000)}, repeat("\x7f", 2000)});
+    res.push_back({"edit-front-long", false, {}, {pasted(8000), "\x01"}, chars(text(500))});
+    res.push_back({"rewrap", true, {}, {pasted(1200), "\x01"}, chars(text(400))});
+    res.push_back({"backspace-wrap", true, {}, {pasted(1600)}, repeat("\x7f", 1000)});
+    std::vector<std::string> options{"none"};
+    for (unsigned i = 1; i <= 300; ++i)
+      options.emplace_back(std::format("option #{}", i));
+    auto nav = repeat("\e[B", 400);
+    nav.append_range(repeat("\e[A", 400));
+    res.push_back({"options", true, std::move(options), {}, std::move(nav)});
+    return res;
+  }
+
+
+  // Read and drop the terminal output.
+  void drain(int master)
+  {
+    std::array<char, 65536> buf;
+    while (::syscall(SYS_read, master, buf.data(), buf.size()) > 0)
+      ;
+  }
+
+
+  // Write KEY to the terminal and process events until the handle read all of it.  Returns true
+  // if the input was finished.
+  bool feed(nrl::handle& h, int master, const std::string& key)
+  {
+    bool done = false;
+    auto target = bytes_in + key.size();
+    size_t written = 0;
+    while (bytes_in < target) {
+      if (written < key.size()) {
+        auto n = ::syscall(SYS_write, master, key.data() + written, key.size() - written);
+        if (n > 0)
+          written += n;
+      }
+
+      std::array<::epoll_event, 4> ev;
+      auto n = ::syscall(SYS_epoll_wait, h.epfd, ev.data(), ev.size(), written < key.size() ? 0 : 1000);
+      if (n <= 0) {
+        drain(master);
+        if (n == 0 && written == key.size())
+          ::error(EXIT_FAILURE, 0, "input not handled");
+        continue;
+      }
+      for (long i = 0; i < n; ++i) {
+        counting = true;
+        auto res = h.process(ev[i]);
+        counting = false;
+        done |= res.has_value();
+      }
+      drain(master);
+    }
+    return done;
+  }
+
+
+  void run(nrl::handle& h, int master, const scenario& sc, result& r)
+  {
+    h.multiline = sc.multiline;
+    h.set_cursor_pos(1, 1);
+    if (sc.options.empty())
+      h.prepare();
+    else
+      h.prepare(sc.options);
+    drain(master);
+
+    for (const auto& k : sc.setup)
+      feed(h, master, k);
+
+    for (const auto& k : sc.keys) {
+      auto calls = nsyscalls;
+      auto allocs = nallocs;
+      auto out = bytes_out;
+      auto t0 = std::chrono::steady_clock::now();
+      feed(h, master, k);
+      auto t1 = std::chrono::steady_clock::now();
+      r.latency_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+      r.syscalls += nsyscalls - calls;
+      r.allocs += nallocs - allocs;
+      r.bytes += bytes_out - out;
+    }
+
+    if (! feed(h, master, "\r"))
+      ::error(EXIT_FAILURE, 0, "input of scenario %s not finished", sc.name);
+    h.reset();
+  }
+
+
+  double percentile(const std::vector<uint64_t>& sorted, double q)
+  {
+    auto idx = std::min(sorted.size() - 1, size_t(q * double(sorted.size())));
+    return double(sorted[idx]) / 1000.0;
+  }
+
+} // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+  std::locale loc = std::locale("C.utf8");
+  std::locale::global(loc);
+
+  // With --check the program is used as a test: once the buffers of the handle have grown in an
+  // unmeasured first round, handling the key strokes must not allocate memory.
+  bool check = argc > 1 && std::string_view(argv[1]) == "--check";
+  if (check) {
+    --argc;
+    ++argv;
+  }
+  auto rounds = argc > 1 ? std::max(1l, std::atol(argv[1])) : check ? 2l : 5l;
+
+  int master;
+  ::winsize ws{.ws_row = 24, .ws_col = 80, .ws_xpixel = 0, .ws_ypixel = 0};
+  if (::openpty(&master, &slave_fd, nullptr, nullptr, &ws) != 0) [[unlikely]]
+    ::error(EXIT_FAILURE, errno, "cannot open pseudo terminal");
+  ::fcntl(master, F_SETFL, ::fcntl(master, F_GETFL) | O_NONBLOCK);
+
+  // There is no real terminal which could be queried for its properties.
+  nrl::handle h(slave_fd, nrl::handle::flags::none, std::make_shared<terminal::info>());
+  h.reusable = true;
+
+  std::println("{:<16} {:>6} {:>9} {:>9} {:>9} {:>9} {:>9} {:>10} {:>9}", "scenario", "keys", "p50 µs", "p90 µs", "p99 µs", "max µs", "calls/key", "allocs/key", "bytes/key");
+  bool failed = false;
+  for (const auto& sc : scenarios()) {
+    if (check) {
+      result warmup;
+      run(h, master, sc, warmup);
+    }
+    result r;
+    for (long i = 0; i < rounds; ++i)
+      run(h, master, sc, r);
+
+    std::ranges::sort(r.latency_ns);
+    auto n = double(r.latency_ns.size());
+    std::println("{:<16} {:>6} {:>9.1f} {:>9.1f} {:>9.1f} {:>9.1f} {:>9.2f} {:>10.3f} {:>9.1f}", sc.name, sc.keys.size(), percentile(r.latency_ns, 0.5), percentile(r.latency_ns, 0.9), percentile(r.latency_ns, 0.99), double(r.latency_ns.back()) / 1000.0, double(r.syscalls) / n, double(r.allocs) / n, double(r.bytes) / n);
+    if (check && r.allocs != 0) {
+      std::println(stderr, "scenario {}: {} allocations in the steady state", sc.name, r.allocs);
+      failed = true;
+    }
+  }
+
+  ::close(master);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
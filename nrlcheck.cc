@@ -0,0 +1,269 @@
+// Differential test of the optimized text and wrapping code.  The source of the library is
+// included so that the internal functions can be called.  Each function is compared with a simple
+// reference on random input: UTF-8 text with wide and combining characters, emoji joined by ZWJ,
+// regional indicators, and line breaks, prompts with escape sequences, and random terminal widths.
+// After random edits the line starts computed incrementally are compared with those of a full scan
+// and with the reference used by NRL_CHECKS.
+//
+// The first argument is the seed of the first case, the second the number of cases.  Built with
+// NRL_FUZZER defined the program is a libFuzzer target instead which takes the decisions made
+// while constructing a case from the fuzzer input.
+#include "nrl.cc"
+
+#include <cstdio>
+#include <print>
+#include <random>
+#include <span>
+
+
+namespace {
+
+  // Source of the decisions made while constructing a case: a pseudo-random number generator or
+  // the input of the fuzzer.  An exhausted fuzzer input yields zeros.
+  struct choices {
+    explicit choices(uint64_t seed) : rng(seed) {}
+    explicit choices(std::span<const uint8_t> data) : fuzz(data), fuzzing(true) {}
+
+    // A number in the range [0,N).
+    size_t operator()(size_t n)
+    {
+      if (! fuzzing)
+        return std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+      size_t v = 0;
+      for (size_t i = 0; i < 2 && ! fuzz.empty(); ++i) {
+        v = (v << 8) | fuzz.front();
+        fuzz = fuzz.subspan(1);
+      }
+      return v % n;
+    }
+
+    std::mt19937_64 rng{};
+    std::span<const uint8_t> fuzz{};
+    bool fuzzing = false;
+  };
+
+
+  // Identification of the case for the error message.
+  uint64_t current_case = 0;
+
+  void check(bool ok, const char* what)
+  {
+    if (! ok) [[unlikely]] {
+      std::println(stderr, "case {}: {} differs from the reference", current_case, what);
+      std::abort();
+    }
+  }
+
+
+  // The pieces of the random text.  Only the first ones take exactly one column.
+  constexpr std::array<std::string_view, 12> pieces{
+    "a", " ", "\N{LATIN SMALL LETTER A WITH DIAERESIS}", "\N{EURO SIGN}", "\N{MUSICAL SYMBOL G CLEF}",
+    "\N{CJK UNIFIED IDEOGRAPH-4E2D}", "\N{FULLWIDTH LATIN CAPITAL LETTER A}", "\N{COMBINING ACUTE ACCENT}", "\N{ZERO WIDTH JOINER}", "\N{GRINNING FACE}",
+    "\N{REGIONAL INDICATOR SYMBOL LETTER D}", "\N{REGIONAL INDICATOR SYMBOL LETTER E}"
+  };
+  constexpr size_t narrow_pieces = 5;
+
+
+  // Random text of at most MAXLEN characters.  Line breaks are only used if BREAKS is true,
+  // characters not using exactly one column only if WIDE is true.
+  std::string random_text(choices& c, size_t maxlen, bool breaks, bool wide)
+  {
+    std::string res;
+    for (auto n = c(maxlen + 1); n > 0; --n)
+      if (breaks && c(8) == 0)
+        res.push_back('\n');
+      else
+        res.append(pieces[c(wide ? pieces.size() : narrow_pieces)]);
+    return res;
+  }
+
+
+  // A prompt with escape sequences between the text.
+  std::string random_prompt(choices& c)
+  {
+    static constexpr std::array<std::string_view, 7> sequences{"\e[m", "\e[0m", "\e[1;31m", "\e[38;2;10;20;30m", "\e[?25h", "\e[", "\e"};
+    std::string res;
+    for (auto n = c(12); n > 0; --n)
+      if (c(3) == 0)
+        res.append(sequences[c(sequences.size())]);
+      else
+        res.append(random_text(c, 4, false, true));
+    return res;
+  }
+
+
+  // Offsets of the characters of TEXT, including the end.
+  std::vector<size_t> char_starts(std::string_view text)
+  {
+    std::vector<size_t> res;
+    for (size_t i = 0; i < text.size(); ++i)
+      if ((text[i] & 0xc0) != 0x80)
+        res.push_back(i);
+    res.push_back(text.size());
+    return res;
+  }
+
+
+  // Fill the buffer with TEXT such that the gap is at a random character boundary.
+  void fill_buffer(nrl::handle& s, choices& c, std::string_view text)
+  {
+    auto starts = char_starts(text);
+    auto at = starts[c(starts.size())];
+    s.buffer.clear();
+    s.buffer.append(text.substr(0, at));
+    s.buffer.append(text.substr(at + (text.size() - at) / 2));
+    s.buffer.insert(at, text.substr(at, (text.size() - at) / 2));
+  }
+
+
+  void check_counting(nrl::handle& s, choices& c)
+  {
+    // Arbitrary bytes, not only valid UTF-8.
+    std::string bytes;
+    for (auto n = c(300); n > 0; --n)
+      bytes.push_back(char(c(256)));
+    auto p = reinterpret_cast<const uint8_t*>(bytes.data());
+    for (size_t start = 0; start < std::min(bytes.size(), 40zu); ++start)
+      check(nrl::count_chars(p + start, bytes.size() - start) == nrl::count_chars_scalar(p + start, bytes.size() - start), "count_chars");
+
+    auto n = c(bytes.size() + 2);
+    auto [i, cnt] = nrl::advance_chars(p, bytes.size(), n);
+    size_t j = 0;
+    size_t ref = 0;
+    for (; j < bytes.size() && (ref < n || (p[j] & 0xc0) == 0x80); ++j)
+      ref += (p[j] & 0xc0) != 0x80;
+    check(i == j && cnt == ref, "advance_chars");
+
+    auto text = random_text(c, 200, true, true);
+    fill_buffer(s, c, text);
+    auto starts = char_starts(text);
+    auto first = c(starts.size());
+    n = c(starts.size() + 2);
+    auto [offset, nchars] = nrl::offset_after_n_chars(s, n, starts[first]);
+    auto last = std::min(first + n, starts.size() - 1);
+    check(offset == starts[last] && nchars == last - first, "offset_after_n_chars");
+  }
+
+
+  // Reference for cleanup_CSI0m.
+  std::string cleanup_reference(std::string_view str, std::string_view colsel)
+  {
+    std::string res;
+    for (size_t i = 0; i < str.size();)
+      if (str.substr(i).starts_with("\e[m")) {
+        res.append(colsel);
+        i += 3;
+      } else if (str.substr(i).starts_with("\e[0m")) {
+        res.append(colsel);
+        i += 4;
+      } else
+        res.push_back(str[i++]);
+    return res;
+  }
+
+
+  void check_prompt(choices& c)
+  {
+    auto prompt = random_prompt(c);
+    check(nrl::nonescape_len(prompt) == nrl::nonescape_len_reference(prompt), "nonescape_len");
+
+    const std::string colsel = c(2) ? "\e[38;2;1;2;3;48;2;4;5;6m" : "\e[m";
+    std::string res = "x";
+    nrl::cleanup_CSI0m(res, prompt, colsel);
+    check(res == "x" + cleanup_reference(prompt, colsel), "cleanup_CSI0m");
+  }
+
+
+  // Compare the incremental update of the line starts after random edits with a full scan.  As in
+  // the library, edits of buffers with line breaks or with the column model are handled by
+  // rewrap, the others by the incremental recompute_line_offset.
+  void check_wrapping(nrl::handle& s, choices& c)
+  {
+    s.term_cols = 1 + c(24);
+    s.prompt_len = c(s.term_cols);
+    s.multiline = true;
+    s.line_breaks = c(2);
+    s.wide = false;
+    auto wide = c(2) == 0;
+    auto text = random_text(c, 300, s.line_breaks, wide);
+    fill_buffer(s, c, text);
+    nrl::note_width(s, text);
+    s.line_offset.assign(1, 0);
+    s.logical.assign(1, 0);
+    nrl::recompute_line_offset(s, 0);
+    nrl::verify_line_offset(s);
+
+    for (auto nedits = c(8); nedits > 0; --nedits) {
+      std::string cur;
+      for (auto sv : s.buffer.segments(0, s.buffer.size()))
+        cur.append(sv);
+      auto starts = char_starts(cur);
+      auto first = c(starts.size());
+      // Some edits span several rows.
+      auto last = std::min(starts.size() - 1, first + (c(4) == 0 ? c(3 * s.term_cols + 1) : c(3)));
+      auto from = starts[first];
+      auto to = c(2) ? from : starts[last];
+      std::string ins = to == from || c(2) ? random_text(c, c(4) == 0 ? 3 * s.term_cols : 3, s.line_breaks, wide) : std::string();
+
+      auto simple = nrl::simple_layout(s);
+      auto r = std::ranges::upper_bound(s.line_offset, from) - s.line_offset.begin() - 1;
+      auto removed = ptrdiff_t(s.buffer.nchars(from, to));
+      s.buffer.erase(from, to);
+      s.buffer.insert(from, ins);
+      nrl::note_width(s, ins);
+      nrl::line_edit e{from + ins.size(), ptrdiff_t(ins.size()) - ptrdiff_t(to - from), ptrdiff_t(s.buffer.nchars(from, from + ins.size())) - removed};
+      if (simple && nrl::simple_layout(s) && ! ins.contains('\n'))
+        nrl::recompute_line_offset(s, r, e);
+      else
+        (void) nrl::rewrap(s, r, e);
+
+      auto rows = s.line_offset;
+      auto logical = s.logical;
+      auto widths = s.row_cols;
+      nrl::recompute_line_offset(s, 0);
+      check(rows == s.line_offset && logical == s.logical && widths == s.row_cols, "incremental line starts");
+      nrl::verify_line_offset(s);
+    }
+  }
+
+
+  void run_case(nrl::handle& s, choices& c)
+  {
+    check_counting(s, c);
+    check_prompt(c);
+    check_wrapping(s, c);
+  }
+
+
+  nrl::handle& test_handle()
+  {
+    // The handle is not used for terminal I/O, only its buffer and wrapping state are used.
+    static nrl::handle s(::open("/dev/null", O_RDWR | O_CLOEXEC), nrl::handle::flags::none, std::make_shared<terminal::info>());
+    return s;
+  }
+
+} // anonymous namespace
+
+
+#ifdef NRL_FUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  choices c(std::span(data, size));
+  run_case(test_handle(), c);
+  return 0;
+}
+#else
+int main(int argc, char* argv[])
+{
+  uint64_t seed = argc > 1 ? std::strtoull(argv[1], nullptr, 0) : 1;
+  uint64_t ncases = argc > 2 ? std::strtoull(argv[2], nullptr, 0) : 5000;
+
+  auto& s = test_handle();
+  for (uint64_t i = 0; i < ncases; ++i) {
+    current_case = seed + i;
+    choices c(current_case);
+    run_case(s, c);
+  }
+  std::println("{} cases passed", ncases);
+}
+#endif
@@ -7,6 +7,9 @@
 #include <cstdlib>
 #include <locale>
 #include <print>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <error.h>
 #include <unistd.h>
@@ -16,6 +19,39 @@
 
 namespace {
 
+  // Complete the word before the cursor with one of a few fixed words.  The result is delivered
+  // right away, a real provider could do this from another thread.
+  void complete_word(nrl::handle& h, std::string_view text, size_t offset, uint64_t token)
+  {
+    static constexpr std::string_view words[]{"apple", "apricot", "banana", "blueberry", "cherry"};
+    auto start = text.substr(0, offset).find_last_of(' ');
+    start = start == std::string_view::npos ? 0 : start + 1;
+    auto word = text.substr(start, offset - start);
+    std::vector<std::string> res;
+    for (auto w : words)
+      if (w.starts_with(word))
+        res.emplace_back(w);
+    h.complete(token, start, std::move(res));
+  }
+
+
+  // Show numbers in a different colour.
+  unsigned highlight_numbers(nrl::handle&, std::string_view row, unsigned state, std::vector<nrl::handle::style_span>& spans)
+  {
+    for (size_t i = 0; i < row.size();) {
+      if (row[i] < '0' || row[i] > '9') {
+        ++i;
+        continue;
+      }
+      auto start = i;
+      while (i < row.size() && row[i] >= '0' && row[i] <= '9')
+        ++i;
+      spans.push_back({unsigned(start), unsigned(i), {80, 160, 255}});
+    }
+    return state;
+  }
+
+
   std::unique_ptr<nrl::handle> new_input(int epfd, nrl::handle::flags fl)
   {
     auto res = std::make_unique<nrl::handle>(epfd, STDIN_FILENO, fl);
@@ -24,6 +60,11 @@ namespace {
 
     res->set_prompt("\e[31mINPUT\e[0m> ");
     res->empty_message = "Type something …";
+    res->reusable = true;
+    // Do not wait for the cursor position in prepare().
+    res->async_pos = true;
+    res->set_completion(complete_word);
+    res->set_highlighter(highlight_numbers);
 
     return res;
   }
@@ -55,8 +96,12 @@ int main(int argc, char* argv[])
 
   auto fl = argc == 1 ? nrl::handle::flags::none : static_cast<nrl::handle::flags>(std::clamp(std::atol(argv[1]), 0l, 2l));
 
+  // Remember the input of this session.
+  nrl::history hist;
+
   {
     auto ps = new_input(epfd, fl);
+    ps->set_history(&hist);
 
     ps->prepare({"otherwise", "option #1", "option #2"}, true);
 
@@ -90,7 +135,8 @@ int main(int argc, char* argv[])
             break;
           std::println("input = {}", *res);
 
-          ps = new_input(epfd, fl);
+          // Reuse the handle for the next input.
+          ps->reset();
           ps->prepare();
         } else if (! res.error())
           std::println("unhandled file descriptor {}", int(epev[0].data.fd));